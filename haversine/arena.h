@@ -0,0 +1,69 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "shared.h"
+
+/*******************************************************************************
+ * Bump arena
+ *
+ * Allocations are carved off the front of large blocks and never freed one at
+ * a time; arena_free() hands every block back at once. Blocks are chained, so
+ * nothing already handed out ever moves.
+ */
+
+#define ARENA_BLOCK (64 << 10)
+#define ARENA_ALIGN 16
+
+struct arena_block {
+  struct arena_block *prev;
+  u64 used;
+  u64 cap;
+  u64 pad; // Keeps bytes[] on malloc()'s 16 byte alignment.
+  u8 bytes[];
+};
+
+struct arena {
+  struct arena_block *block;
+  u64 allocated;
+};
+
+void *arena_push(struct arena *arena, u64 size) {
+  size = (size + ARENA_ALIGN - 1) & ~(u64)(ARENA_ALIGN - 1);
+  struct arena_block *block = arena->block;
+
+  if (block == NULL || block->cap - block->used < size) {
+    u64 cap = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+    block = malloc(sizeof(struct arena_block) + cap);
+    if (block == NULL) {
+      fprintf(stderr, "Could not alloc %"PRIu64" bytes for arena\n", cap);
+      exit(1);
+    }
+
+    block->prev = arena->block;
+    block->used = 0;
+    block->cap = cap;
+    arena->block = block;
+    arena->allocated += cap;
+  }
+
+  void *result = block->bytes + block->used;
+  block->used += size;
+  return result;
+}
+
+void arena_free(struct arena *arena) {
+  struct arena_block *block = arena->block;
+  while (block != NULL) {
+    struct arena_block *prev = block->prev;
+    free(block);
+    block = prev;
+  }
+  arena->block = NULL;
+  arena->allocated = 0;
+}
+
+#endif
@@ -0,0 +1,593 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+#include "prof.h"
+
+#include "fastfloat.h"
+#include "hmath.h"
+#include "input.h"
+#include "reptest.h"
+
+#define BENCH_REPETITIONS 10
+
+static u64 bench_rng_state = 0x9e3779b97f4a7c15ull;
+
+static u64 bench_rand(void) {
+  u64 x = bench_rng_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return bench_rng_state = x;
+}
+
+static f64 bench_rand_range(f64 lo, f64 hi) {
+  return lo + (hi - lo)*((f64)(bench_rand() >> 11) / (f64)(1ull << 53));
+}
+
+static void bench_report(const char *label, u64 ticks, u64 bytes, u64 count, u64 cpu_freq) {
+  f64 seconds = (f64)ticks / (f64)cpu_freq;
+  printf("  %12s: %8.2fms %8.2fns/item %10.2fmb/s\n",
+      label,
+      seconds * 1000,
+      seconds * 1e9 / (f64)count,
+      (f64)bytes / seconds / (1024.0*1024.0));
+}
+
+/*******************************************************************************
+ * parse: fastfloat.h against the atof() path lex() used to take
+ */
+
+struct bench_text {
+  char *bytes;
+  u64 len;
+  u64 cap;
+  u64 *starts;
+  u64 count;
+  u64 starts_cap;
+};
+
+static void bench_text_add(struct bench_text *text, const char *number, u64 len) {
+  while (text->len + len + 1 > text->cap) {
+    text->cap = text->cap ? text->cap * 2 : 1 << 20;
+    text->bytes = realloc(text->bytes, text->cap);
+  }
+
+  if (text->count == text->starts_cap) {
+    text->starts_cap = text->starts_cap ? text->starts_cap * 2 : 1 << 16;
+    text->starts = realloc(text->starts, sizeof(u64) * text->starts_cap);
+  }
+
+  text->starts[text->count++] = text->len;
+  memcpy(text->bytes + text->len, number, len);
+  text->len += len;
+  text->bytes[text->len++] = ' ';
+}
+
+// Pull every number out of a JSON file using the lexer's rules for where
+// numbers start and end.
+static void bench_text_add_file(struct bench_text *text, char *filename) {
+  struct input_file file = read_file(filename, READ_MMAP);
+  char prev = ' ';
+
+  for (u64 i = 0; i < file.size; i++) {
+    char c = file.bytes[i];
+    if ((isdigit(c) || c == '-') && !(isalnum(prev) || prev == '.')) {
+      u64 end = i + 1;
+      while (end < file.size && (isdigit(file.bytes[end]) || file.bytes[end] == '.')) {
+        end++;
+      }
+      bench_text_add(text, file.bytes + i, end - i);
+      i = end - 1;
+    }
+    prev = file.bytes[i];
+  }
+
+  free_input_file(&file);
+}
+
+static int bench_parse(int argc, char **argv) {
+  struct bench_text text = {0};
+
+  // Shapes the fast path has to get right or hand off.
+  const char *edges[] = {
+    "0", "-0", "-0.000000", "0.000000", "180.000000", "-180.000000",
+    "5.", "-5.", "1.5", "9007199254740992", "9007199254740993",
+    "123456789012345678901234567890", "0.1234567890123456789012345",
+    "1.2.3", "-", "-.", "0.0000000000000000000001", "1797693134862315.7",
+  };
+  for (u32 i = 0; i < sizeof(edges)/sizeof(edges[0]); i++) {
+    bench_text_add(&text, edges[i], strlen(edges[i]));
+  }
+
+  if (argc > 0) {
+    bench_text_add_file(&text, argv[0]);
+  } else {
+    for (u32 i = 0; i < 1000000; i++) {
+      char buf[64];
+      f64 range = (i & 1) ? 90.0 : 180.0;
+      int len = snprintf(buf, sizeof(buf), "%f", bench_rand_range(-range, range));
+      bench_text_add(&text, buf, (u64)len);
+    }
+  }
+
+  u64 mismatches = 0;
+  for (u64 i = 0; i < text.count; i++) {
+    f64 fast = 0;
+    u64 end = parse_f64(text.bytes, text.len, text.starts[i], &fast);
+
+    char buf[512] = {0};
+    memcpy(buf, text.bytes + text.starts[i], end - text.starts[i]);
+    f64 slow = atof(buf);
+
+    if (memcmp(&fast, &slow, sizeof(f64)) != 0) {
+      if (mismatches++ < 10) {
+        printf("mismatch: \"%s\" atof=%.17g parse_f64=%.17g\n", buf, slow, fast);
+      }
+    }
+  }
+
+  printf("parse: %"PRIu64" numbers, %"PRIu64" bytes, %"PRIu64" mismatches\n", text.count, text.len, mismatches);
+
+  u64 cpu_freq = prof_estimate_cpu_freq(100);
+  u64 best_atof = ~0ull;
+  u64 best_fast = ~0ull;
+  volatile f64 sink = 0;
+
+  for (u32 r = 0; r < BENCH_REPETITIONS; r++) {
+    f64 sum = 0;
+    u64 start = prof_read_cpu_timer();
+    for (u64 i = 0; i < text.count; i++) {
+      char buf[256] = {0};
+      u64 j = text.starts[i];
+      u32 buf_i = 0;
+      buf[buf_i++] = text.bytes[j];
+      while (isdigit(text.bytes[++j]) || text.bytes[j] == '.') {
+        buf[buf_i++] = text.bytes[j];
+      }
+      sum += atof(buf);
+    }
+    u64 ticks = prof_read_cpu_timer() - start;
+    if (ticks < best_atof) best_atof = ticks;
+
+    start = prof_read_cpu_timer();
+    for (u64 i = 0; i < text.count; i++) {
+      f64 value;
+      parse_f64(text.bytes, text.len, text.starts[i], &value);
+      sum += value;
+    }
+    ticks = prof_read_cpu_timer() - start;
+    if (ticks < best_fast) best_fast = ticks;
+
+    sink += sum;
+  }
+
+  bench_report("atof", best_atof, text.len, text.count, cpu_freq);
+  bench_report("parse_f64", best_fast, text.len, text.count, cpu_freq);
+  printf("  %12s: %8.2fx\n", "speedup", (f64)best_atof / (f64)best_fast);
+
+  free(text.bytes);
+  free(text.starts);
+  return mismatches != 0;
+}
+
+/*******************************************************************************
+ * math: error analysis of the hmath.h approximations against libm
+ *
+ * Each function is swept evenly over the range the formula feeds it, and the
+ * whole formula is checked on random pairs. ulp errors are relative to libm's
+ * result, so they are only meaningful away from zeros (see hmath.h).
+ */
+
+// Relative and ulp error only count where |ref| >= MATH_REL_FLOOR. At the
+// zeros of sin and cos the reference is ~0, so any absolute error there is an
+// enormous relative one and would swamp everything else.
+#define MATH_REL_FLOOR 1e-3
+
+struct math_error {
+  f64 abs;
+  f64 rel;
+  f64 ulp;
+  f64 at;
+};
+
+static void math_error_add(struct math_error *error, f64 approx, f64 ref, f64 x) {
+  f64 abs_error = fabs(approx - ref);
+
+  if (abs_error > error->abs) {
+    error->abs = abs_error;
+  }
+
+  if (fabs(ref) < MATH_REL_FLOOR) {
+    return;
+  }
+
+  f64 rel_error = abs_error / fabs(ref);
+  f64 ulp_error = abs_error / (nextafter(fabs(ref), INFINITY) - fabs(ref));
+
+  if (rel_error > error->rel) {
+    error->rel = rel_error;
+  }
+
+  if (ulp_error > error->ulp) {
+    error->ulp = ulp_error;
+    error->at = x;
+  }
+}
+
+struct math_fn {
+  const char *name;
+  f64 (*approx)(f64);
+  f64 (*ref)(f64);
+  f64 lo;
+  f64 hi;
+};
+
+#define MATH_FNS(tier) { \
+  { "sin", sin_##tier, sin, -HMATH_PI, HMATH_PI }, \
+  { "cos", cos_##tier, cos, -HMATH_HALF_PI, HMATH_HALF_PI }, \
+  { "asin", asin_##tier, asin, 0, 1 }, \
+}
+
+struct math_fn math_fns[MATH_TIER_COUNT][3] = {
+  [MATH_FULL] = MATH_FNS(full),
+  [MATH_FAST] = MATH_FNS(fast),
+  [MATH_FASTER] = MATH_FNS(faster),
+};
+
+f64 (*math_haversines[MATH_TIER_COUNT])(f64, f64, f64, f64) = {
+  [MATH_LIBM] = haversine,
+  [MATH_FULL] = haversine_full,
+  [MATH_FAST] = haversine_fast,
+  [MATH_FASTER] = haversine_faster,
+};
+
+static int bench_math(int argc, char **argv) {
+  u64 samples = argc > 0 ? strtoull(argv[0], NULL, 10) : 1 << 22;
+  u64 pairs = 1 << 20;
+
+  f64 *columns = aligned_alloc(PAIRS_ALIGN, sizeof(f64) * 5 * pairs);
+  f64 *x0 = columns;
+  f64 *y0 = columns + pairs;
+  f64 *x1 = columns + 2*pairs;
+  f64 *y1 = columns + 3*pairs;
+  f64 *out = columns + 4*pairs;
+
+  for (u64 i = 0; i < pairs; i++) {
+    x0[i] = bench_rand_range(-180, 180);
+    y0[i] = bench_rand_range(-90, 90);
+    x1[i] = bench_rand_range(-180, 180);
+    y1[i] = bench_rand_range(-90, 90);
+  }
+
+  u64 cpu_freq = prof_estimate_cpu_freq(100);
+
+  printf("math: %"PRIu64" samples per function, %"PRIu64" pairs\n", samples, pairs);
+
+  for (u32 tier = 0; tier < MATH_TIER_COUNT; tier++) {
+    printf("%s\n", math_tier_names[tier]);
+
+    if (tier != MATH_LIBM) {
+      for (u32 f = 0; f < 3; f++) {
+        struct math_fn fn = math_fns[tier][f];
+        struct math_error error = {0};
+
+        for (u64 i = 0; i < samples; i++) {
+          f64 x = fn.lo + (fn.hi - fn.lo)*((f64)i / (f64)(samples - 1));
+          math_error_add(&error, fn.approx(x), fn.ref(x), x);
+        }
+
+        printf("  %12s: max abs %.3e, max rel %.3e, max %.1f ulp (at %.17g)\n",
+            fn.name, error.abs, error.rel, error.ulp, error.at);
+      }
+
+      // End to end, which is what the tier actually delivers.
+      struct math_error error = {0};
+      for (u64 i = 0; i < pairs; i++) {
+        f64 approx = math_haversines[tier](x0[i], y0[i], x1[i], y1[i]);
+        f64 ref = haversine(x0[i], y0[i], x1[i], y1[i]);
+        math_error_add(&error, approx, ref, (f64)i);
+      }
+
+      printf("  %12s: max abs %.3ekm, max rel %.3e, max %.1f ulp\n", "haversine", error.abs, error.rel, error.ulp);
+    }
+
+    u64 best = ~0ull;
+    volatile f64 sink = 0;
+    for (u32 r = 0; r < BENCH_REPETITIONS; r++) {
+      u64 start = prof_read_cpu_timer();
+      haversine_kernels[tier](x0, y0, x1, y1, out, pairs);
+      sink += sum_f64(out, pairs);
+      u64 ticks = prof_read_cpu_timer() - start;
+      if (ticks < best) best = ticks;
+    }
+
+    bench_report("kernel", best, pairs * sizeof(f64) * 4, pairs, cpu_freq);
+  }
+
+  free(columns);
+  return 0;
+}
+
+/*******************************************************************************
+ * format: fastfloat.h's format_f64 against the snprintf("%f") generator.c used
+ */
+
+static int bench_format(int argc, char **argv) {
+  u64 count = argc > 0 ? strtoull(argv[0], NULL, 10) : 1000000;
+
+  // Ties, values that only just round either way, and the snprintf fallbacks.
+  f64 edges[] = {
+    0.0, -0.0, 0.5, -0.5, 1e-7, -1e-7, 5e-7, -5e-7, 4.9999999999999996e-7,
+    1.0000005, 2.5e-6, 0.0000015, 179.9999995, -179.9999995, 1e-300, -1e-320,
+    9007199254740993.0, 18446744073709.0, 1e13, 1.7e13, 1.8e13, 1e19, 1e300,
+    -1e300, NAN, INFINITY, -INFINITY,
+  };
+  u64 edge_count = sizeof(edges)/sizeof(edges[0]);
+
+  f64 *values = malloc(sizeof(f64) * (count + edge_count));
+  memcpy(values, edges, sizeof(edges));
+  for (u64 i = 0; i < count; i++) {
+    f64 range = (i & 1) ? 90.0 : 180.0;
+    // Every so often a value sitting on a six-place tie, give or take an ulp.
+    if (i % 16 == 0) {
+      f64 tie = (f64)(s64)bench_rand_range(-range*1e6, range*1e6) / 1e6 + 5e-7;
+      values[edge_count + i] = nextafter(tie, (i & 2) ? INFINITY : -INFINITY);
+    } else {
+      values[edge_count + i] = bench_rand_range(-range, range);
+    }
+  }
+  count += edge_count;
+
+  char *slow = malloc(count * 400);
+  char *fast = malloc(count * 400);
+  u64 mismatches = 0;
+
+  for (u64 i = 0; i < count; i++) {
+    char a[400];
+    char b[400];
+    int a_len = snprintf(a, sizeof(a), "%f", values[i]);
+    u32 b_len = format_f64(b, sizeof(b), values[i]);
+
+    if ((u32)a_len != b_len || memcmp(a, b, b_len) != 0) {
+      if (mismatches++ < 10) {
+        printf("mismatch: %a snprintf=%.*s format_f64=%.*s\n", values[i], a_len, a, (int)b_len, b);
+      }
+    }
+  }
+
+  printf("format: %"PRIu64" values, %"PRIu64" mismatches\n", count, mismatches);
+
+  u64 cpu_freq = prof_estimate_cpu_freq(100);
+  u64 best_slow = ~0ull;
+  u64 best_fast = ~0ull;
+  u64 slow_len = 0;
+  u64 fast_len = 0;
+
+  for (u32 r = 0; r < BENCH_REPETITIONS; r++) {
+    u64 start = prof_read_cpu_timer();
+    slow_len = 0;
+    for (u64 i = 0; i < count; i++) {
+      slow_len += (u64)snprintf(slow + slow_len, 400, "%f", values[i]);
+      slow[slow_len++] = ',';
+    }
+    u64 ticks = prof_read_cpu_timer() - start;
+    if (ticks < best_slow) best_slow = ticks;
+
+    start = prof_read_cpu_timer();
+    fast_len = 0;
+    for (u64 i = 0; i < count; i++) {
+      fast_len += format_f64(fast + fast_len, 400, values[i]);
+      fast[fast_len++] = ',';
+    }
+    ticks = prof_read_cpu_timer() - start;
+    if (ticks < best_fast) best_fast = ticks;
+  }
+
+  bench_report("snprintf", best_slow, slow_len, count, cpu_freq);
+  bench_report("format_f64", best_fast, fast_len, count, cpu_freq);
+  printf("  %12s: %8.2fx\n", "speedup", (f64)best_slow / (f64)best_fast);
+
+  free(values);
+  free(slow);
+  free(fast);
+  return mismatches != 0;
+}
+
+/*******************************************************************************
+ * sum: hmath.h's reduction modes, against a long double compensated sum
+ */
+
+static int bench_sum(int argc, char **argv) {
+  u64 count = argc > 0 ? strtoull(argv[0], NULL, 10) : 1 << 20;
+
+  f64 *values = aligned_alloc(PAIRS_ALIGN, sizeof(f64) * count + PAIRS_ALIGN);
+  for (u64 i = 0; i < count; i++) {
+    values[i] = bench_rand_range(0, HMATH_PI * EARTH_RADIUS_KM);
+  }
+
+  long double exact = 0;
+  long double c = 0;
+  for (u64 i = 0; i < count; i++) {
+    long double t = exact + values[i];
+    c += fabsl(exact) >= values[i] ? (exact - t) + values[i] : (values[i] - t) + exact;
+    exact = t;
+  }
+  exact += c;
+
+  u64 cpu_freq = prof_estimate_cpu_freq(100);
+  printf("sum: %"PRIu64" values\n", count);
+
+  for (u32 mode = 0; mode < SUM_MODE_COUNT; mode++) {
+    struct sum_part part = {0};
+    u64 best = ~0ull;
+    for (u32 r = 0; r < BENCH_REPETITIONS; r++) {
+      u64 start = prof_read_cpu_timer();
+      part = sum_batch((enum sum_mode)mode, values, count);
+      u64 ticks = prof_read_cpu_timer() - start;
+      if (ticks < best) best = ticks;
+    }
+
+    f64 sum = part.sum + part.c;
+    printf("  %12s: error %+.3e (%.2f ulp)\n", sum_mode_names[mode],
+        (f64)((long double)sum - exact), fabs((f64)((long double)sum - exact)) / (nextafter(sum, INFINITY) - sum));
+    bench_report(sum_mode_names[mode], best, count * sizeof(f64), count, cpu_freq);
+  }
+
+  free(values);
+  return 0;
+}
+
+/*******************************************************************************
+ * read: the ways into the input, under the repetition tester
+ */
+
+static void bench_read_file(struct rep_tester *tester, char *filename, u64 size, enum read_mode mode) {
+  rep_begin(tester);
+  struct input_file file = read_file(filename, mode);
+  rep_end(tester);
+
+  rep_count_bytes(tester, file.size);
+  free_input_file(&file);
+}
+
+// Plain read() into a fresh buffer, without stdio's copy or locking.
+static void bench_read_syscall(struct rep_tester *tester, char *filename, u64 size, enum read_mode mode) {
+  int fd = open(filename, O_RDONLY);
+  char *bytes = malloc(size);
+  if (fd < 0 || bytes == NULL) {
+    rep_error(tester, "could not open or alloc");
+    if (fd >= 0) close(fd);
+    free(bytes);
+    return;
+  }
+
+  rep_begin(tester);
+  u64 total = 0;
+  while (total < size) {
+    ssize_t got = read(fd, bytes + total, size - total);
+    if (got <= 0) {
+      rep_error(tester, "read failed");
+      break;
+    }
+    total += (u64)got;
+  }
+  rep_end(tester);
+
+  rep_count_bytes(tester, total);
+  free(bytes);
+  close(fd);
+}
+
+// No file at all: the cost of faulting in a buffer the size of the input,
+// which every copying read above pays on top of the copy.
+static void bench_read_touch(struct rep_tester *tester, char *filename, u64 size, enum read_mode mode) {
+  rep_begin(tester);
+  char *bytes = malloc(size);
+  if (bytes == NULL) {
+    rep_end(tester);
+    rep_error(tester, "could not alloc");
+    return;
+  }
+  for (u64 i = 0; i < size; i += 4096) {
+    bytes[i] = (char)i;
+  }
+  rep_end(tester);
+
+  rep_count_bytes(tester, size);
+  free(bytes);
+}
+
+struct bench_read_test {
+  const char *label;
+  void (*run)(struct rep_tester *tester, char *filename, u64 size, enum read_mode mode);
+  enum read_mode mode;
+};
+
+static int bench_read(int argc, char **argv) {
+  if (argc < 1) {
+    fprintf(stderr, "bench read needs an input file\n");
+    return 1;
+  }
+
+  char *filename = argv[0];
+  u32 seconds = argc > 1 ? (u32)strtoul(argv[1], NULL, 10) : 10;
+
+  struct stat stats;
+  if (stat(filename, &stats) != 0 || stats.st_size == 0) {
+    fprintf(stderr, "Could not open %s for reading\n", filename);
+    return 1;
+  }
+  u64 size = (u64)stats.st_size;
+
+  // Every buffer gets its own mapping and gives it back on free(), so each
+  // run faults in fresh pages like the mmap variants do. Left to itself glibc
+  // would serve inputs under its (dynamic) mmap threshold from heap pages an
+  // earlier run already touched, and keep freed heap top around for the next.
+  mallopt(M_MMAP_THRESHOLD, 4096);
+  mallopt(M_TRIM_THRESHOLD, 0);
+  mallopt(M_TOP_PAD, 0);
+
+  struct bench_read_test tests[] = {
+    { "fread", bench_read_file, READ_FREAD },
+    { "read", bench_read_syscall, READ_FREAD },
+    { "mmap", bench_read_file, READ_MMAP },
+    { "hugepage", bench_read_file, READ_MMAP_HUGE },
+    { "malloc-touch", bench_read_touch, READ_FREAD },
+  };
+
+  u64 cpu_freq = prof_estimate_cpu_freq(100);
+  printf("read: %s, %.3fmb, until the min holds for %us\n",
+      filename, (f64)size / (1024.0*1024.0), seconds);
+
+  for (u32 i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+    struct rep_tester tester;
+    rep_new_wave(&tester, tests[i].label, size, cpu_freq, seconds);
+    while (rep_is_testing(&tester)) {
+      tests[i].run(&tester, filename, size, tests[i].mode);
+    }
+    rep_print(&tester);
+  }
+
+  return 0;
+}
+
+struct bench {
+  const char *name;
+  const char *args;
+  int (*run)(int argc, char **argv);
+};
+
+struct bench benches[] = {
+  { "parse", "[file.json]", bench_parse },
+  { "math", "[samples]", bench_math },
+  { "format", "[count]", bench_format },
+  { "sum", "[count]", bench_sum },
+  { "read", "file [seconds]", bench_read },
+};
+
+int main(int argc, char *argv[]) {
+  u32 count = sizeof(benches)/sizeof(benches[0]);
+
+  if (argc >= 2) {
+    for (u32 i = 0; i < count; i++) {
+      if (strcmp(argv[1], benches[i].name) == 0) {
+        return benches[i].run(argc - 2, argv + 2);
+      }
+    }
+  }
+
+  fprintf(stderr, "Usage:\n");
+  for (u32 i = 0; i < count; i++) {
+    fprintf(stderr, "  bench %s %s\n", benches[i].name, benches[i].args);
+  }
+  return 1;
+}
@@ -0,0 +1,235 @@
+#ifndef __FASTFLOAT_H__
+#define __FASTFLOAT_H__
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+/*******************************************************************************
+ * Decimal to double
+ *
+ * Numbers are parsed in place with the same extent rules as the lexer: an
+ * optional '-' followed by any run of digits and '.'. When the digits fit in
+ * 53 bits and there are at most 22 of them after the point, both the mantissa
+ * and the power of ten are exact doubles, so a single correctly rounded
+ * division gives the same bits strtod() would (Clinger's fast path). That
+ * covers everything generator.c writes with %f. Anything else is handed to
+ * strtod() on a terminated copy, exactly what atof() used to see.
+ */
+
+static const f64 parse_f64_pow10[23] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static const u64 parse_u64_pow10[9] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+};
+
+// Fold up to eight leading digits of an 8 byte word into *mantissa at once,
+// returning how many there were. The digit test and the conversion are the
+// usual SWAR tricks: a byte is a digit iff its high nibble is 3 both before
+// and after adding 6, and the digits are combined pairwise in three multiplies.
+static inline u32 parse_f64_swar(const char *p, u64 *mantissa) {
+  u64 v;
+  memcpy(&v, p, sizeof(v));
+
+  u64 nibbles = (v & 0xf0f0f0f0f0f0f0f0ull) | (((v + 0x0606060606060606ull) & 0xf0f0f0f0f0f0f0f0ull) >> 4);
+  u64 mismatch = nibbles ^ 0x3333333333333333ull;
+  u32 n = mismatch ? (u32)__builtin_ctzll(mismatch) / 8 : 8;
+
+  if (n == 0) {
+    return 0;
+  }
+
+  // Drop the non-digit bytes, the zeros shifted in become leading zeros.
+  u64 d = (v - 0x3030303030303030ull) << (8*(8 - n));
+  d = (d * 10) + (d >> 8);
+  d = (((d & 0x000000ff000000ffull) * (100 + (1000000ull << 32))) +
+      (((d >> 16) & 0x000000ff000000ffull) * (1 + (10000ull << 32)))) >> 32;
+
+  *mantissa = *mantissa * parse_u64_pow10[n] + (u32)d;
+  return n;
+}
+
+static u64 parse_f64_slow(const char *bytes, u64 start, u64 end, f64 *out) {
+  char buf[256];
+  char *copy = buf;
+  u64 len = end - start;
+
+  if (len >= sizeof(buf)) {
+    copy = malloc(len + 1);
+  }
+
+  memcpy(copy, bytes + start, len);
+  copy[len] = 0;
+  *out = strtod(copy, NULL);
+
+  if (copy != buf) {
+    free(copy);
+  }
+
+  return end;
+}
+
+// Parse the number starting at bytes[i], returning the index just past it.
+static inline u64 parse_f64(const char *bytes, u64 size, u64 i, f64 *out) {
+  u64 start = i;
+  b32 negative = i < size && bytes[i] == '-';
+  i += negative;
+
+  u64 mantissa = 0;
+  u32 digits = 0;
+
+  if (i + 8 <= size) {
+    digits = parse_f64_swar(bytes + i, &mantissa);
+    i += digits;
+  }
+
+  while (i < size && (u8)(bytes[i] - '0') <= 9) {
+    mantissa = mantissa*10 + (u64)(bytes[i] - '0');
+    digits++;
+    i++;
+  }
+
+  u32 fraction = 0;
+  if (i < size && bytes[i] == '.') {
+    i++;
+    if (i + 8 <= size) {
+      u32 n = parse_f64_swar(bytes + i, &mantissa);
+      fraction += n;
+      i += n;
+    }
+    while (i < size && (u8)(bytes[i] - '0') <= 9) {
+      mantissa = mantissa*10 + (u64)(bytes[i] - '0');
+      fraction++;
+      i++;
+    }
+  }
+
+  digits += fraction;
+
+  // A second '.' still belongs to this token, and strtod decides what it means.
+  if (i < size && bytes[i] == '.') {
+    while (i < size && ((u8)(bytes[i] - '0') <= 9 || bytes[i] == '.')) {
+      i++;
+    }
+    return parse_f64_slow(bytes, start, i, out);
+  }
+
+  if (digits == 0 || digits > 19 || mantissa > (1ull << 53) || fraction > 22) {
+    return parse_f64_slow(bytes, start, i, out);
+  }
+
+  f64 value = (f64)mantissa;
+  if (fraction) {
+    value /= parse_f64_pow10[fraction];
+  }
+
+  *out = negative ? -value : value;
+  return i;
+}
+
+/*******************************************************************************
+ * Double to decimal
+ *
+ * printf("%f") for the values generator.c writes, byte for byte. %f prints the
+ * exact binary value rounded to six places, ties to even, and with doubles
+ * that exact value is m * 2^e for an integer m < 2^53. So the rounding can be
+ * done in integers: m * 10^6 fits in 74 bits, shifting right by -e gives the
+ * six-place result and the bits shifted out decide the rounding exactly. What
+ * is left is printing an integer with a '.' six digits from the end.
+ *
+ * Anything whose result would not fit in 64 bits, and NaN and infinities, go
+ * to snprintf().
+ */
+
+__extension__ typedef unsigned __int128 format_u128;
+
+static const char format_digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+// Digits of value, right aligned so they end at end. Returns the first one.
+static inline char *format_u64_backwards(char *end, u64 value) {
+  while (value >= 100) {
+    end -= 2;
+    memcpy(end, format_digit_pairs + 2*(value % 100), 2);
+    value /= 100;
+  }
+
+  if (value >= 10) {
+    end -= 2;
+    memcpy(end, format_digit_pairs + 2*value, 2);
+  } else {
+    *--end = (char)('0' + value);
+  }
+
+  return end;
+}
+
+// Writes value as "%f" would into out, which has room for cap bytes and gets
+// no terminator. Returns the length.
+static inline u32 format_f64(char *out, u64 cap, f64 value) {
+  u64 bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  b32 negative = (b32)(bits >> 63);
+  s32 exponent = (s32)((bits >> 52) & 0x7ff);
+  u64 mantissa = bits & ((1ull << 52) - 1);
+
+  // Results of 2^64 / 10^6 and up do not fit the integer part below.
+  if (exponent == 0x7ff || exponent >= 1023 + 44) {
+    int len = snprintf(out, cap, "%f", value);
+    return (u32)(len < (int)cap ? len : (int)cap - 1);
+  }
+
+  if (exponent == 0) {
+    exponent = 1;
+  } else {
+    mantissa |= 1ull << 52;
+  }
+
+  // value = mantissa * 2^shift, and shift is always negative here.
+  s32 shift = exponent - 1023 - 52;
+  format_u128 scaled = (format_u128)mantissa * 1000000u;
+  u64 q;
+
+  if (-shift >= 128) {
+    q = 0;
+  } else {
+    u32 s = (u32)-shift;
+    q = (u64)(scaled >> s);
+    format_u128 rest = scaled & ((((format_u128)1) << s) - 1);
+    format_u128 half = ((format_u128)1) << (s - 1);
+    q += rest > half || (rest == half && (q & 1));
+  }
+
+  char buf[32];
+  char *end = buf + sizeof(buf);
+  u32 fraction = (u32)(q % 1000000);
+  u64 whole = q / 1000000;
+
+  // Six fraction digits, then the point, then the integer part.
+  for (u32 i = 0; i < 3; i++) {
+    end -= 2;
+    memcpy(end, format_digit_pairs + 2*(fraction % 100), 2);
+    fraction /= 100;
+  }
+  *--end = '.';
+  char *start = format_u64_backwards(end, whole);
+
+  if (negative) {
+    *--start = '-';
+  }
+
+  u32 len = (u32)(buf + sizeof(buf) - start);
+  memcpy(out, start, len);
+  return len;
+}
+
+#endif
@@ -1,109 +1,341 @@
+#define _GNU_SOURCE
+
+# include <fcntl.h>
 # include <inttypes.h>
 # include <math.h>
 # include <stdio.h>
 # include <stdlib.h>
 # include <string.h>
+# include <sys/stat.h>
+# include <unistd.h>
 
-typedef char unsigned u8;
-typedef short unsigned u16;
-typedef int unsigned u32;
-typedef long long unsigned u64;
-
-typedef char s8;
-typedef short s16;
-typedef int s32;
-typedef long long s64;
-
-typedef float f32;
-typedef double f64;
-
-typedef s32 b32;
+#include "shared.h"
+#include "fastfloat.h"
+#include "hmath.h"
+#include "pairsbin.h"
+#include "pool.h"
 
 enum Mode {
   ModeUniform,
   ModeCluster,
 };
 
-#define rand_uniform() ((f64)rand() / RAND_MAX)
+/*******************************************************************************
+ * Random numbers
+ *
+ * Every coordinate is a pure function of the seed and its position in the
+ * file (splitmix64 over a counter), so any thread can produce any pair without
+ * walking a shared generator state, and the output does not depend on how the
+ * work was split. Counters below RNG_PAIRS_BASE are for per-file parameters.
+ */
+
+#define RNG_PAIRS_BASE 16
+
+static inline u64 rngU64(u64 seed, u64 counter) {
+  u64 z = seed * 0xd1342543de82ef95ull + counter * 0x9e3779b97f4a7c15ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static inline f64 rngUniform(u64 seed, u64 counter) {
+  return (f64)(rngU64(seed, counter) >> 11) * (1.0 / (f64)(1ull << 53));
+}
+
+// Coordinate c of pair i.
+static inline f64 rngPair(u64 seed, u64 i, u32 c) {
+  return rngUniform(seed, RNG_PAIRS_BASE + 4*i + c);
+}
+
+/*******************************************************************************
+ * Pairs
+ */
 
-#define EARTH_RADIUS_KM 6372.8
-#define square(x) ((x)*(x))
-#define deg2rad(d) (0.01745329251994329577*(d))
+struct Cluster {
+  f64 size;
+  f64 x0;
+  f64 y0;
+};
 
-static inline f64 haversine(f64 x0, f64 y0, f64 x1, f64 y1) {
-  f64 dy = deg2rad(y1-y0);
-  f64 dx = deg2rad(x1-x0);
-  f64 ry0 = deg2rad(y0);
-  f64 ry1 = deg2rad(y1);
+struct Shape {
+  enum Mode mode;
+  u64 seed;
+  // Cluster mode: 2 random squares on the globe, 1 point from each.
+  struct Cluster a;
+  struct Cluster b;
+};
 
-  f64 a = square(sin(dy/2.0)) + cos(ry0)*cos(ry1)*square(sin(dx/2.0));
-  f64 c = 2.0*asin(sqrt(a));
+static struct Cluster makeCluster(u64 seed, u64 counter) {
+  struct Cluster cluster;
+  cluster.size = 30.0*rngUniform(seed, counter);
+  cluster.x0 = ((360.0-cluster.size)*rngUniform(seed, counter + 1))-180;
+  cluster.y0 = ((180.0-cluster.size)*rngUniform(seed, counter + 2))-90;
+  return cluster;
+}
 
-  return EARTH_RADIUS_KM * c;
+static inline void makePair(struct Shape *shape, u64 i, f64 p[4]) {
+  if (shape->mode == ModeCluster) {
+    p[0] = shape->a.x0 + (shape->a.size*rngPair(shape->seed, i, 0));
+    p[1] = shape->a.y0 + (shape->a.size*rngPair(shape->seed, i, 1));
+    p[2] = shape->b.x0 + (shape->b.size*rngPair(shape->seed, i, 2));
+    p[3] = shape->b.y0 + (shape->b.size*rngPair(shape->seed, i, 3));
+  } else {
+    p[0] = (360.0*rngPair(shape->seed, i, 0))-180;
+    p[1] = (180.0*rngPair(shape->seed, i, 1))-90;
+    p[2] = (360.0*rngPair(shape->seed, i, 2))-180;
+    p[3] = (180.0*rngPair(shape->seed, i, 3))-90;
+  }
 }
 
-f64 writeUniformPairs(FILE *fp, u64 pairs) {
-  u64 i;
-  char sep = ',';
+/*******************************************************************************
+ * Output
+ *
+ * The pairs are cut into chunks of GEN_CHUNK. Each round every thread formats
+ * one chunk into its own buffer, then the main thread lays the buffers out one
+ * after the other and every thread pwrite()s its own at that offset. The
+ * binary and answers files have fixed size records, so those slices go out
+ * straight away. Each chunk's sum lands in its own slot and the slots are
+ * added in order at the end, so `expected` does not depend on the thread
+ * count either.
+ */
+
+#define GEN_CHUNK 65536
+#define GEN_RECORD_MAX 128
+
+struct Outputs {
+  int json;
+  // Pipes cannot seek, so the JSON goes out in order from the main thread.
+  b32 json_stream;
+  struct pairs_writer *bin;
+  int answers;
+};
 
-  f64 sum = 0;
+struct Buffer {
+  char *text;
+  u64 len;
+  u64 offset;
+  f64 *columns[4];
+  f64 *answers;
+  s32 *scratch;
+} __attribute__((aligned(64)));
+
+struct Generator {
+  struct Shape shape;
+  struct Outputs out;
+  u64 pairs;
+  u64 round;
+  struct Buffer *buffers;
+  struct sum_part *chunk_sums;
+};
 
-  for (i = 0; i < pairs; i++) {
-    if (i == pairs - 1) {
-      sep = ' ';
+// Same bytes as fprintf("{\"x0\": %f, \"y0\": %f, \"x1\": %f, \"y1\": %f}%c"),
+// at most GEN_RECORD_MAX of them for coordinates in range.
+static inline u32 formatPair(char *out, f64 p[4], char sep) {
+  static const char keys[4][9] = {"{\"x0\": ", ", \"y0\": ", ", \"x1\": ", ", \"y1\": "};
+  static const u32 key_lens[4] = {7, 8, 8, 8};
+  u32 len = 0;
+
+  for (u32 c = 0; c < 4; c++) {
+    memcpy(out + len, keys[c], 8);
+    len += key_lens[c];
+    len += format_f64(out + len, 24, p[c]);
+  }
+
+  out[len++] = '}';
+  out[len++] = sep;
+  return len;
+}
+
+static void writeAll(int fd, const void *bytes, u64 size, u64 offset) {
+  if (!pairs_pwrite(fd, bytes, size, offset)) {
+    fprintf(stderr, "Unable to write output\n");
+    exit(1);
+  }
+}
+
+// The binary file and the answers get the values back from the text, so they
+// match what a JSON reader sees.
+static void formatChunk(void *ctx, u32 thread_index, u32 thread_count) {
+  struct Generator *gen = ctx;
+  struct Buffer *buffer = &gen->buffers[thread_index];
+  u64 chunk = gen->round * thread_count + thread_index;
+  u64 first = chunk * GEN_CHUNK;
+
+  buffer->len = 0;
+  if (first >= gen->pairs) {
+    return;
+  }
+
+  u64 count = gen->pairs - first < GEN_CHUNK ? gen->pairs - first : GEN_CHUNK;
+  b32 parse = gen->out.bin != NULL || gen->out.answers >= 0;
+  struct sum_part sum = {0};
+
+  for (u64 i = 0; i < count; i++) {
+    f64 p[4];
+    makePair(&gen->shape, first + i, p);
+    sum_neumaier(&sum.sum, &sum.c, haversine(p[0], p[1], p[2], p[3]));
+
+    char *record = buffer->text + buffer->len;
+    u32 len = formatPair(record, p, first + i == gen->pairs - 1 ? ' ' : ',');
+
+    if (parse) {
+      // Skip `{"x0": `, then `, "y0": ` and so on.
+      u64 at = 7;
+      for (u32 c = 0; c < 4; c++) {
+        at = parse_f64(record, len, at, &buffer->columns[c][i]) + 8;
+      }
+      buffer->answers[i] = haversine(buffer->columns[0][i], buffer->columns[1][i],
+          buffer->columns[2][i], buffer->columns[3][i]);
     }
 
-    f64 x0 = (360.0*rand_uniform())-180;
-    f64 y0 = (180.0*rand_uniform())-90;
-    f64 x1 = (360.0*rand_uniform())-180;
-    f64 y1 = (180.0*rand_uniform())-90;
-    sum += haversine(x0, y0, x1, y1);
+    buffer->len += len;
+  }
+
+  gen->chunk_sums[chunk] = sum;
 
-    fprintf(fp, "{\"x0\": %f, \"y0\": %f, \"x1\": %f, \"y1\": %f}%c", 
-        x0, y0, x1, y1, sep);
+  if (gen->out.bin != NULL) {
+    pairs_writer_write(gen->out.bin, first, count, buffer->columns, buffer->scratch);
   }
 
-  return (f64)sum/(f64)pairs;
+  if (gen->out.answers >= 0) {
+    writeAll(gen->out.answers, buffer->answers, sizeof(f64) * count, sizeof(f64) * first);
+  }
 }
 
-f64 writeClusterPairs(FILE *fp, u64 pairs) {
-  // Define 2 random squares on the globe and pull 1 point from each
-  f64 a_size = 30.0*rand_uniform();
-  f64 a_x0 = ((360.0-a_size)*rand_uniform())-180;
-  f64 a_y0 = ((180.0-a_size)*rand_uniform())-90;
+static void writeJson(struct Outputs *out, const void *bytes, u64 size, u64 offset) {
+  if (!out->json_stream) {
+    writeAll(out->json, bytes, size, offset);
+    return;
+  }
 
-  f64 b_size = 30.0*rand_uniform();
-  f64 b_x0 = ((360.0-b_size)*rand_uniform())-180;
-  f64 b_y0 = ((180.0-b_size)*rand_uniform())-90;
+  while (size) {
+    ssize_t n = write(out->json, bytes, size);
+    if (n <= 0) {
+      fprintf(stderr, "Unable to write output\n");
+      exit(1);
+    }
+    bytes = (const char *)bytes + n;
+    size -= (u64)n;
+  }
+}
 
-  u64 i;
-  char sep = ',';
+static void writeChunk(void *ctx, u32 thread_index, u32 thread_count) {
+  struct Generator *gen = ctx;
+  struct Buffer *buffer = &gen->buffers[thread_index];
+  writeJson(&gen->out, buffer->text, buffer->len, buffer->offset);
+}
 
-  f64 sum = 0;
+// Returns the offset just past the last pair.
+static u64 writePairs(struct Generator *gen, struct pool *pool, u64 offset, f64 *average) {
+  u32 threads = pool->count;
+  u64 chunks = (gen->pairs + GEN_CHUNK - 1) / GEN_CHUNK;
 
-  for (i = 0; i < pairs; i++) {
-    if (i == pairs - 1) {
-      sep = ' ';
+  gen->chunk_sums = calloc(chunks + 1, sizeof(struct sum_part));
+  gen->buffers = aligned_alloc(64, sizeof(struct Buffer) * threads);
+
+  for (u32 t = 0; t < threads; t++) {
+    struct Buffer *buffer = &gen->buffers[t];
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->text = malloc(GEN_CHUNK * GEN_RECORD_MAX);
+    for (u32 c = 0; c < 4; c++) {
+      buffer->columns[c] = malloc(sizeof(f64) * GEN_CHUNK);
     }
+    buffer->answers = malloc(sizeof(f64) * GEN_CHUNK);
+    buffer->scratch = malloc(sizeof(s32) * GEN_CHUNK);
+  }
 
-    f64 x0 = a_x0 + (a_size*rand_uniform());
-    f64 y0 = a_y0 + (a_size*rand_uniform());
-    f64 x1 = b_x0 + (b_size*rand_uniform());
-    f64 y1 = b_y0 + (b_size*rand_uniform());
-    sum += haversine(x0, y0, x1, y1);
+  for (gen->round = 0; gen->round * threads < chunks; gen->round++) {
+    pool_run(pool, formatChunk, gen);
 
-    fprintf(fp, "{\"x0\": %f, \"y0\": %f, \"x1\": %f, \"y1\": %f}%c", 
-        x0, y0, x1, y1, sep);
+    for (u32 t = 0; t < threads; t++) {
+      gen->buffers[t].offset = offset;
+      offset += gen->buffers[t].len;
+    }
+
+    if (gen->out.json_stream) {
+      for (u32 t = 0; t < threads; t++) {
+        writeChunk(gen, t, threads);
+      }
+    } else {
+      pool_run(pool, writeChunk, gen);
+    }
   }
 
-  return (f64)sum/(f64)pairs;
+  // Compensated, so `expected` is something the reader's sums can be
+  // measured against, whatever the count.
+  struct sum_acc total = {0};
+  for (u64 k = 0; k < chunks; k++) {
+    sum_acc_add(&total, SUM_KAHAN, gen->chunk_sums[k]);
+  }
+  struct sum_part sum = sum_acc_result(&total, SUM_KAHAN);
+
+  for (u32 t = 0; t < threads; t++) {
+    struct Buffer *buffer = &gen->buffers[t];
+    free(buffer->text);
+    for (u32 c = 0; c < 4; c++) {
+      free(buffer->columns[c]);
+    }
+    free(buffer->answers);
+    free(buffer->scratch);
+  }
+  free(gen->buffers);
+  free(gen->chunk_sums);
+
+  *average = (sum.sum + sum.c)/(f64)gen->pairs;
+  return offset;
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: generator cluster/uniform seed pairs\n");
+static int openOutput(char *name) {
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s for writing\n", name);
     exit(1);
   }
+  return fd;
+}
+
+void usage(void) {
+  fprintf(stderr, "Usage: generator [-a] [-b f64|q32] [-j threads] [-o out.json|-] cluster/uniform seed pairs\n"
+      "The JSON goes to stdout with -o - or when stdout is a pipe.\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  b32 answers = 0;
+  b32 binary = 0;
+  enum pairs_encoding encoding = PAIRS_F64;
+  u32 threads = 0;
+  char *output_name = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "ab:j:o:")) != -1) {
+    switch (opt) {
+      case 'a':
+        answers = 1;
+        break;
+      case 'b':
+        if (!parse_pairs_encoding(optarg, &encoding)) {
+          fprintf(stderr, "Unknown encoding: %s\n", optarg);
+          usage();
+        }
+        binary = 1;
+        break;
+      case 'j':
+        threads = (u32)atoi(optarg);
+        break;
+      case 'o':
+        output_name = optarg;
+        break;
+      default:
+        usage();
+    }
+  }
+
+  if (argc - optind != 3) {
+    usage();
+  }
+
+  argv += optind - 1;
 
   u8 mode;
 
@@ -119,26 +351,72 @@ int main(int argc, char *argv[]) {
   u32 seed = (u32)atoi(argv[2]);
   u64 pairs = atoll(argv[3]);
 
-  srand(seed);
+  struct Generator gen = {
+    .shape = {
+      .mode = (enum Mode)mode,
+      .seed = seed,
+      .a = makeCluster(seed, 0),
+      .b = makeCluster(seed, 3),
+    },
+    .pairs = pairs,
+    .out = {
+      .json = -1,
+      .answers = -1,
+    },
+  };
 
 #define OUTPUT_NAME_BUF_SIZE 256
   char output_name_buf[OUTPUT_NAME_BUF_SIZE] = {0};
-  snprintf(output_name_buf, OUTPUT_NAME_BUF_SIZE, "haversine_%d_%u_%llu.json", mode, seed, pairs);
+  snprintf(output_name_buf, OUTPUT_NAME_BUF_SIZE, "haversine_%d_%u_%"PRIu64".json", mode, seed, pairs);
 
-  FILE *fp = fopen(output_name_buf, "w");
-  fprintf(fp, "{\"pairs\": [");
+  if (binary) {
+    char bin_name_buf[OUTPUT_NAME_BUF_SIZE] = {0};
+    snprintf(bin_name_buf, OUTPUT_NAME_BUF_SIZE, "haversine_%d_%u_%"PRIu64".pairs", mode, seed, pairs);
+    gen.out.bin = open_pairs_writer(bin_name_buf, encoding, pairs);
+  }
+
+  // One raw f64 per pair, in pair order.
+  if (answers) {
+    char answers_name_buf[OUTPUT_NAME_BUF_SIZE] = {0};
+    snprintf(answers_name_buf, OUTPUT_NAME_BUF_SIZE, "haversine_%d_%u_%"PRIu64"_answers.f64", mode, seed, pairs);
+    gen.out.answers = openOutput(answers_name_buf);
+  }
+
+  struct stat stdout_stats;
+  if (output_name == NULL && fstat(STDOUT_FILENO, &stdout_stats) == 0 && S_ISFIFO(stdout_stats.st_mode)) {
+    output_name = "-";
+  }
 
+  if (output_name != NULL && strcmp(output_name, "-") == 0) {
+    gen.out.json = STDOUT_FILENO;
+    gen.out.json_stream = 1;
+  } else {
+    gen.out.json = openOutput(output_name != NULL ? output_name : output_name_buf);
+  }
+
+  const char header[] = "{\"pairs\": [";
+  writeJson(&gen.out, header, sizeof(header) - 1, 0);
+
+  struct pool pool;
+  pool_init(&pool, threads);
   f64 average;
-  switch (mode) {
-    case ModeUniform:
-      average = writeUniformPairs(fp, pairs);
-      break;
-    case ModeCluster:
-      average = writeClusterPairs(fp, pairs);
-      break;
+  u64 end = writePairs(&gen, &pool, sizeof(header) - 1, &average);
+  pool_destroy(&pool);
+
+  char trailer[64];
+  int trailer_len = snprintf(trailer, sizeof(trailer), "], \"expected\": %f}", average);
+  writeJson(&gen.out, trailer, (u64)trailer_len, end);
+  if (!gen.out.json_stream) {
+    close(gen.out.json);
+  }
+
+  if (gen.out.bin != NULL) {
+    close_pairs_writer(gen.out.bin, average, seed, mode);
+  }
+
+  if (gen.out.answers >= 0) {
+    close(gen.out.answers);
   }
 
-  fprintf(fp, "], \"expected\": %f}", average);
-  fclose(fp);
   return 0;
 }
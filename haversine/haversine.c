@@ -1,14 +1,17 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <ctype.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 #include <x86intrin.h>
 
 #include "shared.h"
@@ -16,6 +19,13 @@
 #define PROF_ENABLE 1
 #include "prof.h"
 
+#include "arena.h"
+#include "fastfloat.h"
+#include "hmath.h"
+#include "input.h"
+#include "pairsbin.h"
+#include "pool.h"
+
 /*******************************************************************************
  * Debug helpers
  */
@@ -49,204 +59,503 @@ enum token_type {
   TOKEN_COLON,
   TOKEN_IDENT,
   TOKEN_NUMBER,
+  TOKEN_PAIR,
 
   TOKEN_UNKNOWN,
 };
 
-struct token {
-  enum token_type type;
-  union {
-    char *ident;
-    f64 number;
-    char unknown;
-  } value;
-}; 
+// Identifiers are interned at lex time. The known keys have fixed ids, with
+// the pair components first so an id doubles as a column index.
+enum symbol {
+  SYMBOL_X0,
+  SYMBOL_Y0,
+  SYMBOL_X1,
+  SYMBOL_Y1,
+  SYMBOL_PAIRS,
+  SYMBOL_EXPECTED,
+
+  SYMBOL_BUILTIN_COUNT,
+};
+
+#define SYMBOLS_MAX 1024
+
+struct symbols {
+  struct arena arena;
+  u32 count;
+  u32 lengths[SYMBOLS_MAX];
+  const char *names[SYMBOLS_MAX];
+};
+
+// How many pair objects matched the generator's byte template, see
+// pair_template(), and how many had to go the long way.
+struct template_stats {
+  u64 hits;
+  u64 misses;
+};
+
+// The lexer's output, one column per kind of payload. Every token has a byte
+// in `types`; numbers and identifiers also have the next entry of their own
+// column, in order, so a reader walks all three with separate cursors. A
+// TOKEN_PAIR is a whole pair object, with x0, y0, x1 and y1 in `numbers`.
+struct tokens {
+  u8 *types;
+  f64 *numbers;
+  u16 *symbols;
+  u64 len;
+  u64 numbers_len;
+  u64 symbols_len;
+  u64 reserved;
+  struct template_stats templates;
+};
 
 typedef f64 pair[4];
 
 struct json_input {
-  pair *pairs;
-  u32 pairs_len;
+  f64 *x0;
+  f64 *y0;
+  f64 *x1;
+  f64 *y1;
+  u64 pairs_len;
+  u64 pairs_cap;
   f64 expected;
+  b32 mapped;
 };
 
-// Convert [x0, x1, y0, y1] to [0, 1, 2, 3]
-#define ident2index(s) (s[1]+(s[0]<<1)-288)
+// Convert [x0, y0, x1, y1] to [0, 1, 2, 3]
+#define ident2index(s) (((s[1]-'0')<<1)+(s[0]-'x'))
 
-#define EARTH_RADIUS_KM 6372.8
-#define square(x) ((x)*(x))
-#define deg2rad(d) (0.01745329251994329577*(d))
+static f64 *pairs_column_alloc(u64 count) {
+  u64 size = (sizeof(f64) * count + PAIRS_ALIGN - 1) & ~(u64)(PAIRS_ALIGN - 1);
+  f64 *column = aligned_alloc(PAIRS_ALIGN, size ? size : PAIRS_ALIGN);
 
-static inline f64 haversine(f64 x0, f64 y0, f64 x1, f64 y1) {
-  f64 dy = deg2rad(y1-y0);
-  f64 dx = deg2rad(x1-x0);
-  f64 ry0 = deg2rad(y0);
-  f64 ry1 = deg2rad(y1);
+  if (column == NULL) {
+    fprintf(stderr, "Could not alloc %"PRIu64" bytes for pairs\n", size);
+    exit(1);
+  }
 
-  f64 a = square(sin(dy/2.0)) + cos(ry0)*cos(ry1)*square(sin(dx/2.0));
-  f64 c = 2.0*asin(sqrt(a));
+  return column;
+}
 
-  return EARTH_RADIUS_KM * c;
+// realloc() would not keep the alignment, so columns are moved by hand.
+static f64 *pairs_column_resize(f64 *column, u64 len, u64 cap) {
+  f64 *resized = pairs_column_alloc(cap);
+  if (column != NULL) {
+    memcpy(resized, column, sizeof(f64) * len);
+    free(column);
+  }
+  return resized;
 }
 
-char *read_file(char *filename, u64 *size) {
-  FILE *input_file = fopen(filename, "rb");
+void json_input_reserve(struct json_input *input, u64 cap) {
+  input->x0 = pairs_column_resize(input->x0, input->pairs_len, cap);
+  input->y0 = pairs_column_resize(input->y0, input->pairs_len, cap);
+  input->x1 = pairs_column_resize(input->x1, input->pairs_len, cap);
+  input->y1 = pairs_column_resize(input->y1, input->pairs_len, cap);
+  input->pairs_cap = cap;
+}
 
-  if (input_file == NULL) {
-    fprintf(stderr, "Could not open %s for reading\n", filename);
-    exit(1);
+void free_json_input(struct json_input *input) {
+  // Columns borrowed from a binary file go away with its mapping.
+  if (input->mapped) {
+    return;
   }
 
-  struct stat stats;
+  free(input->x0);
+  free(input->y0);
+  free(input->x1);
+  free(input->y1);
+  input->x0 = input->y0 = input->x1 = input->y1 = NULL;
+}
+
+/*******************************************************************************
+ * Lexer
+ *
+ * The input is classified 64 bytes at a time into bitmasks, and tokenization
+ * only visits the set bits of the non-whitespace mask. Structural characters
+ * are emitted straight from a table and number starts jump to the number path;
+ * everything else goes through lex_token(), which is the original byte-wise
+ * lexer for a single token, so the masks only ever speed things up and never
+ * change what is produced.
+ */
+
+struct lex_masks {
+  u64 whitespace;
+  u64 structural;
+  u64 number;
+  u64 word;
+};
+
+const u8 lex_structural_types[256] = {
+  ['{'] = TOKEN_LSQUIRLY,
+  ['}'] = TOKEN_RSQUIRLY,
+  ['['] = TOKEN_LBRACKET,
+  [']'] = TOKEN_RBRACKET,
+  ['"'] = TOKEN_DQUOTE,
+  [','] = TOKEN_COMMA,
+  [':'] = TOKEN_COLON,
+};
+
+// Unsigned (x - lo) <= (hi - lo), as 0xff lanes.
+#define LEX_RANGE_SSE2(x, lo, hi) \
+  _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(x, _mm_set1_epi8(lo)), _mm_set1_epi8((hi)-(lo))), \
+      _mm_sub_epi8(x, _mm_set1_epi8(lo)))
+#define LEX_RANGE_AVX2(x, lo, hi) \
+  _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8(x, _mm256_set1_epi8(lo)), _mm256_set1_epi8((hi)-(lo))), \
+      _mm256_sub_epi8(x, _mm256_set1_epi8(lo)))
+
+// `number` starts out as every digit and '-', and `word` as everything that
+// can continue a number or identifier. lex_finish_masks() turns the former into
+// number starts once the whole block is known.
+static void lex_classify_sse2(const char *bytes, struct lex_masks *masks) {
+  *masks = (struct lex_masks){0};
+
+  for (u32 k = 0; k < 4; k++) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(bytes + 16*k));
+
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), LEX_RANGE_SSE2(x, '\t', '\r'));
+
+    __m128i st = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('{')), _mm_cmpeq_epi8(x, _mm_set1_epi8('}'))),
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('[')), _mm_cmpeq_epi8(x, _mm_set1_epi8(']'))));
+    st = _mm_or_si128(st, _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+          _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(',')), _mm_cmpeq_epi8(x, _mm_set1_epi8(':')))));
 
-  stat(filename, &stats);
-  *size = stats.st_size;
-  char *bytes = malloc(*size);
+    __m128i digit = LEX_RANGE_SSE2(x, '0', '9');
+    __m128i alpha = LEX_RANGE_SSE2(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z');
+    __m128i num = _mm_or_si128(digit, _mm_cmpeq_epi8(x, _mm_set1_epi8('-')));
+    __m128i word = _mm_or_si128(_mm_or_si128(digit, alpha), _mm_cmpeq_epi8(x, _mm_set1_epi8('.')));
 
-  if (bytes == NULL) {
-    fprintf(stderr, "Could not alloc %"PRIu64" bytes for reading %s\n", *size, filename);
-    fclose(input_file);
+    masks->whitespace |= (u64)(u16)_mm_movemask_epi8(ws) << (16*k);
+    masks->structural |= (u64)(u16)_mm_movemask_epi8(st) << (16*k);
+    masks->number |= (u64)(u16)_mm_movemask_epi8(num) << (16*k);
+    masks->word |= (u64)(u16)_mm_movemask_epi8(word) << (16*k);
+  }
+}
+
+__attribute__((target("avx2")))
+static void lex_classify_avx2(const char *bytes, struct lex_masks *masks) {
+  *masks = (struct lex_masks){0};
+
+  for (u32 k = 0; k < 2; k++) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(bytes + 32*k));
+
+    __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), LEX_RANGE_AVX2(x, '\t', '\r'));
+
+    __m256i st = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('}'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('[')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8(']'))));
+    st = _mm256_or_si256(st, _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+          _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(',')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8(':')))));
+
+    __m256i digit = LEX_RANGE_AVX2(x, '0', '9');
+    __m256i alpha = LEX_RANGE_AVX2(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 'z');
+    __m256i num = _mm256_or_si256(digit, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('-')));
+    __m256i word = _mm256_or_si256(_mm256_or_si256(digit, alpha), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('.')));
+
+    masks->whitespace |= (u64)(u32)_mm256_movemask_epi8(ws) << (32*k);
+    masks->structural |= (u64)(u32)_mm256_movemask_epi8(st) << (32*k);
+    masks->number |= (u64)(u32)_mm256_movemask_epi8(num) << (32*k);
+    masks->word |= (u64)(u32)_mm256_movemask_epi8(word) << (32*k);
+  }
+}
+
+// A digit or '-' only starts a number when the byte before it could not have
+// been part of a number or identifier. `carry` holds that for the last byte
+// of the previous block.
+static inline void lex_finish_masks(struct lex_masks *masks, u64 *carry) {
+  u64 word = masks->word;
+  masks->number &= ~((word << 1) | *carry);
+  *carry = word >> 63;
+}
+
+void init_symbols(struct symbols *symbols) {
+  static const char *builtin[SYMBOL_BUILTIN_COUNT] = {
+    [SYMBOL_X0] = "x0",
+    [SYMBOL_Y0] = "y0",
+    [SYMBOL_X1] = "x1",
+    [SYMBOL_Y1] = "y1",
+    [SYMBOL_PAIRS] = "pairs",
+    [SYMBOL_EXPECTED] = "expected",
+  };
+
+  *symbols = (struct symbols){0};
+  for (u32 i = 0; i < SYMBOL_BUILTIN_COUNT; i++) {
+    symbols->names[i] = builtin[i];
+    symbols->lengths[i] = (u32)strlen(builtin[i]);
+  }
+  symbols->count = SYMBOL_BUILTIN_COUNT;
+}
+
+void free_symbols(struct symbols *symbols) {
+  arena_free(&symbols->arena);
+}
+
+// Only keys this program has never heard of get copied, into the arena.
+u32 intern(struct symbols *symbols, const char *name, u64 len) {
+  if (len == 2 && (name[0] == 'x' || name[0] == 'y') && (name[1] == '0' || name[1] == '1')) {
+    return (u32)ident2index(name);
+  }
+
+  for (u32 i = SYMBOL_PAIRS; i < symbols->count; i++) {
+    if (symbols->lengths[i] == len && memcmp(symbols->names[i], name, len) == 0) {
+      return i;
+    }
+  }
+
+  if (symbols->count == SYMBOLS_MAX) {
+    fprintf(stderr, "More than %d distinct keys in input\n", SYMBOLS_MAX);
     exit(1);
   }
 
-  {
-    PROF_BANDWIDTH("read", *size);
-    if(fread(bytes, *size, 1, input_file) != 1) {
-      fprintf(stderr, "Unable to read %s\n", filename);
-      free(bytes);
-      exit(1);
+  char *copy = arena_push(&symbols->arena, len + 1);
+  memcpy(copy, name, len);
+  copy[len] = 0;
+
+  u32 symbol = symbols->count++;
+  symbols->names[symbol] = copy;
+  symbols->lengths[symbol] = (u32)len;
+  return symbol;
+}
+
+// The generator writes every pair as `{"x0": N, "y0": N, "x1": N, "y1": N}`
+// with nothing else in between, so an object starting at bytes[i] is first
+// matched against that byte for byte and its numbers parsed in place. Returns
+// the index just past the '}', or 0 as soon as anything deviates (including
+// running out of bytes) and the caller has to take its general path instead.
+static inline u64 pair_template(char *bytes, u64 size, u64 i, pair p) {
+  static const char keys[4][8] = {"{\"x0\": ", ", \"y0\": ", ", \"x1\": ", ", \"y1\": "};
+  static const u32 key_lens[4] = {7, 8, 8, 8};
+  // Keys are compared as one 8 byte word, the first without its last byte.
+  static const u64 key_masks[4] = {0x00ffffffffffffffull, ~0ull, ~0ull, ~0ull};
+
+  for (u32 c = 0; c < 4; c++) {
+    // A key, a digit and the '}' at the very least.
+    if (size - i < 10) {
+      return 0;
+    }
+
+    u64 key, have;
+    memcpy(&key, keys[c], sizeof(key));
+    memcpy(&have, bytes + i, sizeof(have));
+    if ((key ^ have) & key_masks[c]) {
+      return 0;
+    }
+    i += key_lens[c];
+
+    if (!isdigit(bytes[i]) && bytes[i] != '-') {
+      return 0;
+    }
+    i = parse_f64(bytes, size, i, &p[c]);
+  }
+
+  if (i == size || bytes[i] != '}') {
+    return 0;
+  }
+  return i + 1;
+}
+
+static inline u64 lex_number(char *bytes, u64 size, u64 i, struct tokens *tokens) {
+  tokens->types[tokens->len++] = TOKEN_NUMBER;
+  return parse_f64(bytes, size, i, &tokens->numbers[tokens->numbers_len++]);
+}
+
+// Lex the single token starting at bytes[i], returning the index just past
+// it. Returns i+1 without emitting anything for whitespace.
+static u64 lex_token(char *bytes, u64 size, u64 i, struct tokens *tokens, struct symbols *symbols) {
+  char c = bytes[i];
+
+  if (lex_structural_types[(u8)c]) {
+    tokens->types[tokens->len++] = lex_structural_types[(u8)c];
+    return i + 1;
+  }
+
+  if (isdigit(c) || c == '-') {
+    return lex_number(bytes, size, i, tokens);
+  }
+
+  if (isalnum(c)) {
+    u64 end = i + 1;
+    while (end < size && isalnum(bytes[end])) {
+      end++;
     }
+    tokens->types[tokens->len++] = TOKEN_IDENT;
+    tokens->symbols[tokens->symbols_len++] = (u16)intern(symbols, bytes + i, end - i);
+    return end;
+  }
+
+  if (!isspace(c)) {
+    tokens->types[tokens->len++] = TOKEN_UNKNOWN;
+  }
+
+  return i + 1;
+}
+
+// Every token is at least one byte, so the input's length bounds every column
+// and they are reserved at that size up front instead of grown. The mapping
+// is only address space: pages past what the lexer writes are never touched,
+// so memory follows the token count rather than the bound.
+static void *tokens_reserve_column(u64 size) {
+  void *column = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (column == MAP_FAILED) {
+    fprintf(stderr, "Could not reserve %"PRIu64" bytes for tokens\n", size);
+    exit(1);
+  }
+  return column;
+}
+
+struct tokens reserve_tokens(u64 size) {
+  // Plus one for TOKEN_END.
+  u64 count = size + 1;
+  struct tokens tokens = {
+    .types = tokens_reserve_column(count),
+    .numbers = tokens_reserve_column(count * sizeof(f64)),
+    .symbols = tokens_reserve_column(count * sizeof(u16)),
+    .reserved = count,
+  };
+  return tokens;
+}
+
+// What the tokens actually occupy, as opposed to the reservation.
+u64 tokens_bytes(struct tokens *tokens) {
+  return tokens->len + tokens->numbers_len * sizeof(f64) + tokens->symbols_len * sizeof(u16);
+}
+
+void free_tokens(struct tokens *tokens) {
+  if (tokens->types == NULL) {
+    return;
   }
 
-  fclose(input_file);
-  return bytes;
+  munmap(tokens->types, tokens->reserved);
+  munmap(tokens->numbers, tokens->reserved * sizeof(f64));
+  munmap(tokens->symbols, tokens->reserved * sizeof(u16));
+  *tokens = (struct tokens){0};
 }
 
-struct token *lex(char *bytes, u64 size, u64 *num_tokens) {
+struct tokens lex(char *bytes, u64 size, struct symbols *symbols) {
   PROF_BANDWIDTH(__func__, size);
 
-  u32 tokens_cap = 1024;
-  u32 tokens_len = 0;
-  struct token *tokens = malloc(sizeof(struct token) * tokens_cap);
+  void (*classify)(const char *, struct lex_masks *) = lex_classify_sse2;
+  if (__builtin_cpu_supports("avx2")) {
+    classify = lex_classify_avx2;
+  }
+
+  struct tokens tokens = reserve_tokens(size);
 
+  // Everything before `i` has been consumed.
   u64 i = 0;
-  for (; i < size; i++) {
-    char c = bytes[i];
-    switch (c) {
-      case '{':
-        tokens[tokens_len++] = (struct token) {
-          .type = TOKEN_LSQUIRLY,
-        };
-        break;
-      case '}':
-        tokens[tokens_len++] = (struct token) {
-          .type = TOKEN_RSQUIRLY,
-        };
-        break;
-      case '[':
-        tokens[tokens_len++] = (struct token) {
-          .type = TOKEN_LBRACKET,
-        };
-        break;
-      case ']':
-        tokens[tokens_len++] = (struct token) {
-          .type = TOKEN_RBRACKET,
-        };
-        break;
-      case '"':
-        tokens[tokens_len++] = (struct token) {
-          .type = TOKEN_DQUOTE,
-        };
-        break;
-      case ',':
-        tokens[tokens_len++] = (struct token) {
-          .type = TOKEN_COMMA,
-        };
-        break;
-      case ':':
-        tokens[tokens_len++] = (struct token) {
-          .type = TOKEN_COLON,
-        };
-        break;
-      default:
-        {
-          if (isdigit(c) || c == '-') {
-            u32 buf_i = 0;
-            char buf[256] = {0};
-            buf[buf_i++] = c;
-            while (isdigit((c = bytes[++i])) || c == '.') {
-              buf[buf_i++] = c;
-            }
-            i--;
-            tokens[tokens_len++] = (struct token) {
-              .type = TOKEN_NUMBER,
-              .value = { .number = atof(buf) },
-            };
-          } else if (isalnum(c)) {
-            u32 buf_i = 0;
-            char *buf = calloc(128, sizeof(char));
-            buf[buf_i++] = c;
-            while (isalnum((c = bytes[++i]))) {
-              buf[buf_i++] = c;
-            }
-            i--;
-            buf = realloc(buf, strlen(buf)+1);
-            tokens[tokens_len++] = (struct token) {
-              .type = TOKEN_IDENT,
-              .value = { .ident = buf },
-            };
-          } else if (!isspace(c)) {
-            tokens[tokens_len++] = (struct token) {
-              .type = TOKEN_UNKNOWN,
-              .value = { .unknown = c },
-            };
-            break;
+  u64 carry = 0;
+
+  // Nesting, only to tell which objects are in the pairs array: those are the
+  // ones the template stats count, as in the streaming paths.
+  u32 depth = 0;
+  u32 pairs_depth = 0;
+
+  for (u64 base = 0; base < size; base += 64) {
+    struct lex_masks masks;
+
+    if (size - base >= 64) {
+      classify(bytes + base, &masks);
+    } else {
+      // Pad the tail with whitespace so it never yields candidates.
+      char tail[64];
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, bytes + base, size - base);
+      classify(tail, &masks);
+    }
+    lex_finish_masks(&masks, &carry);
+
+    u64 candidates = ~masks.whitespace;
+    if (i > base) {
+      candidates &= (i - base) >= 64 ? 0 : ~0ull << (i - base);
+    }
+
+    while (candidates) {
+      u64 bit = 1ull << __builtin_ctzll(candidates);
+      u64 pos = base + (u64)__builtin_ctzll(candidates);
+
+      if (masks.structural & bit) {
+        i = 0;
+        if (bytes[pos] == '{') {
+          i = pair_template(bytes, size, pos, &tokens.numbers[tokens.numbers_len]);
+          if (pairs_depth && depth == pairs_depth) {
+            tokens.templates.hits += i != 0;
+            tokens.templates.misses += i == 0;
           }
         }
-        break;
+
+        if (i) {
+          tokens.types[tokens.len++] = TOKEN_PAIR;
+          tokens.numbers_len += 4;
+        } else {
+          u8 type = lex_structural_types[(u8)bytes[pos]];
+          tokens.types[tokens.len++] = type;
+          i = pos + 1;
+
+          // "pairs": [ at the top level, as DQUOTE IDENT DQUOTE COLON LBRACKET.
+          if (type == TOKEN_LBRACKET && depth == 1 && tokens.len >= 5 &&
+              tokens.types[tokens.len - 2] == TOKEN_COLON &&
+              tokens.types[tokens.len - 4] == TOKEN_IDENT &&
+              tokens.symbols[tokens.symbols_len - 1] == SYMBOL_PAIRS) {
+            pairs_depth = depth + 1;
+          }
+
+          if (type == TOKEN_LSQUIRLY || type == TOKEN_LBRACKET) {
+            depth++;
+          } else if ((type == TOKEN_RSQUIRLY || type == TOKEN_RBRACKET) && depth) {
+            pairs_depth = depth == pairs_depth ? 0 : pairs_depth;
+            depth--;
+          }
+        }
+      } else if (masks.number & bit) {
+        i = lex_number(bytes, size, pos, &tokens);
+      } else {
+        i = lex_token(bytes, size, pos, &tokens, symbols);
+      }
+
+      candidates &= (i - base) >= 64 ? 0 : ~0ull << (i - base);
     }
 
-    if (tokens_len >= tokens_cap) {
-      tokens_cap <<= 1;
-      tokens = realloc(tokens, sizeof(struct token) * tokens_cap);
+    // A template can run past the next block, which would then be classified
+    // for nothing. Go straight to the block holding `i`.
+    if (i >= base + 128) {
+      base = (i & ~63ull) - 64;
+      char last = bytes[base + 63];
+      carry = isalnum(last) || last == '.';
     }
   }
 
-  tokens[tokens_len++] = (struct token) {
-    .type = TOKEN_END,
-  };
-
-  *num_tokens = tokens_len;
-
-  tokens = realloc(tokens, sizeof(struct token) * tokens_len);
+  tokens.types[tokens.len++] = TOKEN_END;
   return tokens;
 }
 
+struct json_input parse(struct tokens *tokens) {
+  PROF_BANDWIDTH(__func__, tokens_bytes(tokens));
 
-struct json_input parse(struct token *tokens, u64 num_tokens) {
-  PROF_BANDWIDTH(__func__, num_tokens * sizeof(struct token));
+  const u8 *types = tokens->types;
+  const f64 *numbers = tokens->numbers;
+  const u16 *symbols = tokens->symbols;
+
+  // Four numbers a pair is also a bound, so the columns never grow.
+  struct json_input input = {0};
+  json_input_reserve(&input, tokens->numbers_len / 4 + 1);
+  f64 *columns[4] = { input.x0, input.y0, input.x1, input.y1 };
 
-  u32 pairs_cap = 1024;
-  struct json_input input = {
-    .pairs = malloc(sizeof(pair) * pairs_cap),
-    .pairs_len = 0,
-    .expected = 0,
-  };
-  
   u32 stack[1024] = {0};
   u32 sp = 0;
 
-  u32 i = 0;
-  struct token curr = tokens[i++];
-  while (curr.type != TOKEN_END) {
-    switch (curr.type) {
+  u64 i = 0;
+  u64 n = 0;
+  u64 k = 0;
+  u8 type = types[i++];
+  while (type != TOKEN_END) {
+    switch (type) {
       case TOKEN_LSQUIRLY:
       case TOKEN_LBRACKET:
       case TOKEN_DQUOTE:
         if (sp && stack[sp-1] == TOKEN_DQUOTE) {
           assert(stack[--sp] == TOKEN_DQUOTE);
         } else {
-          stack[sp++] = curr.type;
+          stack[sp++] = type;
         }
         break;
       case TOKEN_RSQUIRLY:
@@ -255,103 +564,1335 @@ struct json_input parse(struct token *tokens, u64 num_tokens) {
       case TOKEN_RBRACKET:
         assert(stack[--sp] == TOKEN_LBRACKET);
         break;
-      case TOKEN_IDENT:
+      case TOKEN_NUMBER:
+        n++;
+        break;
+      case TOKEN_PAIR:
+        // Inside the top level object and the pairs array.
+        if (sp == 2) {
+          for (int j = 0; j < 4; j++) {
+            columns[j][input.pairs_len] = numbers[n + j];
+          }
+
+          input.pairs_len++;
+
+          if (input.pairs_len >= input.pairs_cap) {
+            json_input_reserve(&input, input.pairs_cap << 1);
+            columns[0] = input.x0;
+            columns[1] = input.y0;
+            columns[2] = input.x1;
+            columns[3] = input.y1;
+          }
+        }
+        n += 4;
+        break;
+      case TOKEN_IDENT: {
+        u16 symbol = symbols[k++];
         if (sp == 2) {
-          if (strcmp(curr.value.ident, "expected") == 0) {
-            assert((curr = tokens[i++]).type == TOKEN_DQUOTE);
+          if (symbol == SYMBOL_EXPECTED) {
+            assert(types[i++] == TOKEN_DQUOTE);
             assert(stack[--sp] == TOKEN_DQUOTE);
-            assert((curr = tokens[i++]).type == TOKEN_COLON);
-            assert((curr = tokens[i++]).type == TOKEN_NUMBER);
-            input.expected = curr.value.number;
+            assert(types[i++] == TOKEN_COLON);
+            assert(types[i++] == TOKEN_NUMBER);
+            input.expected = numbers[n++];
           } else {
-            assert(strcmp(curr.value.ident, "pairs") == 0);
+            assert(symbol == SYMBOL_PAIRS);
           }
         } else if (sp == 4) {
           // Find all 4 components of a pair
           for (int j = 0; j < 4; j++) {
-            char *curr_ident = curr.value.ident;
+            assert(symbol < 4);
 
-            assert((curr = tokens[i++]).type == TOKEN_DQUOTE);
+            assert(types[i++] == TOKEN_DQUOTE);
             assert(stack[--sp] == TOKEN_DQUOTE);
-            assert((curr = tokens[i++]).type == TOKEN_COLON);
-            assert((curr = tokens[i++]).type == TOKEN_NUMBER);
-            input.pairs[input.pairs_len][ident2index(curr_ident)] = curr.value.number;
+            assert(types[i++] == TOKEN_COLON);
+            assert(types[i++] == TOKEN_NUMBER);
+            columns[symbol][input.pairs_len] = numbers[n++];
 
             if (j != 3) {
-              assert((curr = tokens[i++]).type == TOKEN_COMMA);
-              assert((curr = tokens[i++]).type == TOKEN_DQUOTE);
-              stack[sp++] = curr.type;
-              assert((curr = tokens[i++]).type == TOKEN_IDENT);
+              assert(types[i++] == TOKEN_COMMA);
+              assert(types[i++] == TOKEN_DQUOTE);
+              stack[sp++] = TOKEN_DQUOTE;
+              assert(types[i++] == TOKEN_IDENT);
+              symbol = symbols[k++];
             }
           }
 
           input.pairs_len++;
 
-          if (input.pairs_len >= pairs_cap) {
-            pairs_cap <<= 1;
-            input.pairs = realloc(input.pairs, sizeof(pair) * pairs_cap);
+          if (input.pairs_len >= input.pairs_cap) {
+            json_input_reserve(&input, input.pairs_cap << 1);
+            columns[0] = input.x0;
+            columns[1] = input.y0;
+            columns[2] = input.x1;
+            columns[3] = input.y1;
           }
         }
         break;
+      }
       default:
         break;
     }
 
-    curr = tokens[i++];
+    type = types[i++];
   }
 
   assert(sp == 0);
 
-  input.pairs = realloc(input.pairs, sizeof(pair) * input.pairs_len);
   return input;
 }
 
-f64 sum_pairs(struct json_input *input) {
-  PROF_BANDWIDTH("sum", input->pairs_len * sizeof(pair));
+/*******************************************************************************
+ * Binary pairs
+ *
+ * Files written by `generator -b` (see pairsbin.h) skip lexing and parsing:
+ * f64 columns are used in place, q32 columns are decoded into fresh ones.
+ */
+
+b32 is_pairs_file(char *filename) {
+  struct pairs_header header = {0};
+  int fd = open(filename, O_RDONLY);
 
-  f64 sum = 0;
-  for (u32 i = 0; i < input->pairs_len; i++) {
-    sum += haversine(input->pairs[i][0], input->pairs[i][2], input->pairs[i][1], input->pairs[i][3]);
+  if (fd < 0) {
+    return 0;
   }
-  return sum;
+
+  b32 result = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && header.magic == PAIRS_MAGIC;
+  close(fd);
+  return result;
 }
 
-int main(int argc, char *argv[]) {
-  PROF_INIT();
+struct json_input load_pairs(struct input_file *file) {
+  struct json_input input = {0};
+  struct pairs_header header;
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage: haversine filename\n");
+  if (file->size < sizeof(header)) {
+    fprintf(stderr, "Truncated pairs file\n");
     exit(1);
   }
 
-  u64 file_size = 0;
-  char *file_bytes = read_file(argv[1], &file_size);
+  memcpy(&header, file->bytes, sizeof(header));
 
-  u64 num_tokens = 0;
-  struct token *tokens = lex(file_bytes, file_size, &num_tokens);
-  struct json_input input = parse(tokens, num_tokens);
+  if (!pairs_header_valid(&header, file->size)) {
+    fprintf(stderr, "Invalid pairs file header\n");
+    exit(1);
+  }
 
-  f64 sum = sum_pairs(&input);
-  f64 average = (f64)sum/input.pairs_len;
-  printf("expected = %12.6f\nactual   = %12.6f\n", input.expected, average);
+  input.pairs_len = input.pairs_cap = header.count;
+  input.expected = header.expected;
 
-  {
-    PROF_BANDWIDTH("cleanup", (file_size) + (input.pairs_len * sizeof(pair)) + (num_tokens * sizeof(struct token)));
-    if (file_bytes != NULL) free(file_bytes);
-    if (input.pairs != NULL) free(input.pairs);
-    if (tokens != NULL) {
-      u32 i = 0;
-      struct token curr = tokens[i++];
-      while (curr.type != TOKEN_END) {
-        if (curr.type == TOKEN_IDENT) {
-          free(curr.value.ident);
-        }
-        curr = tokens[i++];
-      }
-      free(tokens);
+  char *columns[4];
+  for (u32 c = 0; c < 4; c++) {
+    columns[c] = file->bytes + pairs_column_offset(&header, c);
+  }
+
+  if (header.encoding == PAIRS_F64) {
+    input.x0 = (f64 *)columns[0];
+    input.y0 = (f64 *)columns[1];
+    input.x1 = (f64 *)columns[2];
+    input.y1 = (f64 *)columns[3];
+    input.mapped = 1;
+    return input;
+  }
+
+  PROF_BANDWIDTH("decode", 4 * header.column_stride);
+
+  json_input_reserve(&input, input.pairs_len);
+  pairs_decode_q32(input.x0, (s32 *)columns[0], header.count, header.scale);
+  pairs_decode_q32(input.y0, (s32 *)columns[1], header.count, header.scale);
+  pairs_decode_q32(input.x1, (s32 *)columns[2], header.count, header.scale);
+  pairs_decode_q32(input.y1, (s32 *)columns[3], header.count, header.scale);
+  return input;
+}
+
+/*******************************************************************************
+ * Parse cache
+ *
+ * With -c, the columns parsed out of a JSON file are saved next to it as
+ * `<file>.cache`, a binary pairs file that also records which JSON it came
+ * from. A later run whose JSON still matches maps the cache instead of reading
+ * and parsing anything.
+ *
+ * The identity is the size, the mtime and a hash of every byte. Sampling
+ * would be cheaper but lets an edit in place that keeps size and mtime
+ * (touch -r, filesystems with coarse mtimes) hit with stale pairs. The whole
+ * file is mapped and hashed four words at a time, which runs at several GB/s,
+ * still far ahead of lexing and parsing it.
+ */
+
+#define CACHE_SUFFIX ".cache"
+#define CACHE_HASH_LANES 4
+
+struct cache_key {
+  u64 size;
+  s64 mtime_sec;
+  s64 mtime_nsec;
+  u64 hash;
+};
+
+// Independent lanes so the multiplies overlap instead of forming one chain.
+static u64 cache_hash(u64 seed, const u8 *bytes, u64 len) {
+  u64 lanes[CACHE_HASH_LANES];
+  for (u32 l = 0; l < CACHE_HASH_LANES; l++) {
+    lanes[l] = seed + l;
+  }
+
+  u64 stride = 8 * CACHE_HASH_LANES;
+  u64 i = 0;
+  for (; i + stride <= len; i += stride) {
+    for (u32 l = 0; l < CACHE_HASH_LANES; l++) {
+      u64 word;
+      memcpy(&word, bytes + i + 8*l, sizeof(word));
+      lanes[l] = (lanes[l] ^ word) * 0x9e3779b97f4a7c15ull;
+      lanes[l] ^= lanes[l] >> 29;
     }
   }
 
-  return 0;
+  u64 hash = seed;
+  for (u32 l = 0; l < CACHE_HASH_LANES; l++) {
+    hash = (hash ^ lanes[l]) * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 29;
+  }
+
+  for (; i < len; i++) {
+    hash = (hash ^ bytes[i]) * 0x9e3779b97f4a7c15ull;
+  }
+
+  return hash;
+}
+
+struct cache_key cache_key(char *filename) {
+  PROF_FUNCTION();
+
+  struct cache_key key = {0};
+  struct stat stats;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &stats) != 0) {
+    fprintf(stderr, "Could not open %s for reading\n", filename);
+    exit(1);
+  }
+
+  key.size = stats.st_size;
+  key.mtime_sec = stats.st_mtim.tv_sec;
+  key.mtime_nsec = stats.st_mtim.tv_nsec;
+  close(fd);
+
+  struct input_file file = read_file(filename, READ_MMAP);
+  key.hash = cache_hash(key.size, (const u8 *)file.bytes, file.size);
+  free_input_file(&file);
+
+  return key;
+}
+
+static char *cache_name(char *filename) {
+  u64 len = strlen(filename);
+  char *name = malloc(len + sizeof(CACHE_SUFFIX));
+  memcpy(name, filename, len);
+  memcpy(name + len, CACHE_SUFFIX, sizeof(CACHE_SUFFIX));
+  return name;
+}
+
+// On a hit the cache stays mapped in *file and *input borrows its columns.
+b32 cache_load(char *name, struct cache_key *key, struct input_file *file, struct json_input *input, u64 *parse_us) {
+  if (!is_pairs_file(name)) {
+    return 0;
+  }
+
+  struct input_file cache = read_file(name, READ_MMAP);
+  struct pairs_header header;
+  memcpy(&header, cache.bytes, sizeof(header));
+
+  b32 hit = pairs_header_valid(&header, cache.size) &&
+    header.encoding == PAIRS_F64 &&
+    header.source_size == key->size &&
+    header.source_mtime_sec == key->mtime_sec &&
+    header.source_mtime_nsec == key->mtime_nsec &&
+    header.source_hash == key->hash;
+
+  if (!hit) {
+    free_input_file(&cache);
+    return 0;
+  }
+
+  *file = cache;
+  *input = load_pairs(file);
+  *parse_us = header.source_parse_us;
+  return 1;
+}
+
+void cache_store(char *name, struct cache_key *key, struct json_input *input, u64 parse_us) {
+  PROF_FUNCTION();
+
+  struct pairs_header header = {
+    .count = input->pairs_len,
+    .expected = input->expected,
+    .source_size = key->size,
+    .source_mtime_sec = key->mtime_sec,
+    .source_mtime_nsec = key->mtime_nsec,
+    .source_hash = key->hash,
+    .source_parse_us = parse_us,
+  };
+  f64 *columns[4] = {input->x0, input->y0, input->x1, input->y1};
+  write_pairs_file(name, &header, columns);
+}
+
+/*******************************************************************************
+ * Summation
+ *
+ * Sums always have the same shape: the kernel sums batches of SUM_BATCH pairs,
+ * batch sums are combined in order into blocks of SUM_BLOCK pairs, and block
+ * sums are combined in order into the total, all under one reduction mode (see
+ * hmath.h). Threads only ever own whole blocks, so
+ * the printed average is bit-identical for any thread count, and the fused
+ * mode, which builds the same shape incrementally, matches it too.
+ */
+
+#define SUM_BATCH 1024
+#define SUM_BLOCK (64*SUM_BATCH)
+
+/*
+ * Validation compares every distance against a reference answers file (see
+ * `generator -a`) while it is still in the kernel's batch, so the only extra
+ * work is one streaming read and a compare per pair. The answers are read
+ * through the same sliding window as out of core input, one per thread over
+ * that thread's range, so only a few steps of them are ever resident. Each
+ * thread keeps its own tally and the few worst offenders it saw, merged once
+ * at the end.
+ */
+
+#define VALIDATE_WORST 8
+
+struct validate_offender {
+  u64 index;
+  f64 value;
+  f64 answer;
+};
+
+struct validation {
+  struct input_window answers;
+  f64 tolerance;
+
+  u64 over;
+  f64 max_error;
+  u32 worst_len;
+  struct validate_offender worst[VALIDATE_WORST];
+} __attribute__((aligned(64)));
+
+static void validate_record(struct validation *validation, struct validate_offender offender) {
+  f64 error = fabs(offender.value - offender.answer);
+  u32 i = validation->worst_len;
+
+  while (i > 0 && fabs(validation->worst[i-1].value - validation->worst[i-1].answer) < error) {
+    if (i < VALIDATE_WORST) {
+      validation->worst[i] = validation->worst[i-1];
+    }
+    i--;
+  }
+
+  if (i < VALIDATE_WORST) {
+    validation->worst[i] = offender;
+    if (validation->worst_len < VALIDATE_WORST) {
+      validation->worst_len++;
+    }
+  }
 }
 
+// The first loop is branch free so it vectorizes, the second only runs for
+// batches that have something to report.
+static void validate_batch(struct validation *validation, const f64 *values, const f64 *answers, u64 first, u64 count) {
+  f64 tolerance = validation->tolerance;
+  f64 max_error = validation->max_error;
+  u64 over = 0;
+
+  for (u64 i = 0; i < count; i++) {
+    f64 error = fabs(values[i] - answers[i]);
+    max_error = error > max_error ? error : max_error;
+    over += error > tolerance;
+  }
+
+  validation->max_error = max_error;
+
+  if (over == 0) {
+    return;
+  }
+
+  validation->over += over;
+  for (u64 i = 0; i < count; i++) {
+    if (fabs(values[i] - answers[i]) > tolerance) {
+      validate_record(validation, (struct validate_offender){first + i, values[i], answers[i]});
+    }
+  }
+}
+
+// One block sum per cache line, written only by the thread that owns it.
+struct sum_partial {
+  struct sum_part part;
+  u8 pad[64 - sizeof(struct sum_part)];
+};
+
+struct sum_job {
+  struct json_input *input;
+  haversine_kernel *kernel;
+  enum sum_mode mode;
+  struct sum_partial *partials;
+  u64 block_count;
+  struct validation *validations;
+};
+
+static struct sum_part sum_block(struct sum_job *job, u64 start, u64 count, struct validation *validation) {
+  struct json_input *input = job->input;
+  f64 values[SUM_BATCH] __attribute__((aligned(PAIRS_ALIGN)));
+  struct sum_acc block = {0};
+
+  for (u64 i = start; i < start + count; i += SUM_BATCH) {
+    u64 n = start + count - i < SUM_BATCH ? start + count - i : SUM_BATCH;
+    job->kernel(input->x0 + i, input->y0 + i, input->x1 + i, input->y1 + i, values, n);
+
+    if (validation != NULL) {
+      struct input_window *answers = &validation->answers;
+      validate_batch(validation, values, (const f64 *)(answers->bytes + i * sizeof(f64)), i, n);
+      input_window_advance(answers, n * sizeof(f64));
+    }
+
+    sum_acc_add(&block, job->mode, sum_batch(job->mode, values, n));
+  }
+
+  return sum_acc_result(&block, job->mode);
+}
+
+static void sum_task(void *ctx, u32 thread_index, u32 thread_count) {
+  struct sum_job *job = ctx;
+  struct json_input *input = job->input;
+  struct validation *validation = job->validations ? &job->validations[thread_index] : NULL;
+
+  u64 first = job->block_count * thread_index / thread_count;
+  u64 last = job->block_count * (thread_index + 1) / thread_count;
+  u64 end = last * SUM_BLOCK < input->pairs_len ? last * SUM_BLOCK : input->pairs_len;
+  u64 pairs = first * SUM_BLOCK < end ? end - first * SUM_BLOCK : 0;
+
+  PROF_BANDWIDTH("sum:task", pairs * sizeof(pair));
+
+  if (validation != NULL && pairs) {
+    input_window_seek(&validation->answers, first * SUM_BLOCK * sizeof(f64));
+  }
+
+  for (u64 b = first; b < last; b++) {
+    u64 start = b * SUM_BLOCK;
+    u64 count = input->pairs_len - start < SUM_BLOCK ? input->pairs_len - start : SUM_BLOCK;
+    job->partials[b].part = sum_block(job, start, count, validation);
+  }
+}
+
+// validation is optional, when given its answers must cover every pair.
+f64 sum_pairs(struct json_input *input, enum math_tier tier, enum sum_mode mode, struct pool *pool, struct validation *validation) {
+  PROF_BANDWIDTH("sum", input->pairs_len * sizeof(pair) + (validation ? input->pairs_len * sizeof(f64) : 0));
+
+  struct sum_job job = {
+    .input = input,
+    .kernel = haversine_kernels[tier],
+    .mode = mode,
+    .block_count = (input->pairs_len + SUM_BLOCK - 1) / SUM_BLOCK,
+  };
+  job.partials = aligned_alloc(64, sizeof(struct sum_partial) * (job.block_count + 1));
+
+  if (validation != NULL) {
+    job.validations = aligned_alloc(64, sizeof(struct validation) * pool->count);
+    for (u32 t = 0; t < pool->count; t++) {
+      job.validations[t] = (struct validation){
+        .answers = validation->answers,
+        .tolerance = validation->tolerance,
+      };
+    }
+  }
+
+  pool_run(pool, sum_task, &job);
+
+  struct sum_acc total = {0};
+  for (u64 b = 0; b < job.block_count; b++) {
+    sum_acc_add(&total, mode, job.partials[b].part);
+  }
+  struct sum_part part = sum_acc_result(&total, mode);
+  f64 sum = part.sum + part.c;
+
+  if (validation != NULL) {
+    for (u32 t = 0; t < pool->count; t++) {
+      struct validation *thread = &job.validations[t];
+      validation->over += thread->over;
+      validation->max_error = thread->max_error > validation->max_error ? thread->max_error : validation->max_error;
+      for (u32 i = 0; i < thread->worst_len; i++) {
+        validate_record(validation, thread->worst[i]);
+      }
+    }
+    free(job.validations);
+  }
+
+  free(job.partials);
+  return sum;
+}
+
+// The exact sum of the same per-pair values sum_pairs() reduces, computed
+// serially; only for reporting.
+f64 reference_pairs(struct json_input *input, enum math_tier tier) {
+  f64 values[SUM_BATCH] __attribute__((aligned(PAIRS_ALIGN)));
+  struct sum_reference ref = {0};
+
+  for (u64 i = 0; i < input->pairs_len; i += SUM_BATCH) {
+    u64 n = input->pairs_len - i < SUM_BATCH ? input->pairs_len - i : SUM_BATCH;
+    haversine_kernels[tier](input->x0 + i, input->y0 + i, input->x1 + i, input->y1 + i, values, n);
+    sum_reference_add(&ref, values, n);
+  }
+
+  return sum_reference_result(&ref);
+}
+
+/*******************************************************************************
+ * Fused streaming
+ *
+ * Scans the bytes once and feeds each pair straight into the accumulator, so
+ * nothing proportional to the input is ever materialized. Only whole steps (a
+ * top level key/value or one pair object) are committed, which lets a buffer
+ * end anywhere: the caller refills and resumes from the returned offset.
+ */
+
+enum stream_phase {
+  STREAM_OPEN,
+  STREAM_KEY,
+  STREAM_PAIRS_FIRST,
+  STREAM_PAIRS_NEXT,
+  STREAM_NEXT,
+  STREAM_DONE,
+};
+
+// Pairs are gathered into one kernel batch, which stays in L1 and is summed
+// in exactly the shape sum_pairs() uses.
+#define STREAM_BATCH SUM_BATCH
+
+struct stream_state {
+  enum stream_phase phase;
+  enum math_tier tier;
+  enum sum_mode sum_mode;
+  b32 stop_at_pairs;
+  f64 sum;
+  struct sum_acc block;
+  struct sum_acc total;
+  // Only kept when asked for, see print_sum().
+  b32 reference;
+  struct sum_reference reference_sum;
+  u64 pairs_len;
+  f64 expected;
+  struct template_stats templates;
+
+  u32 batch_len;
+  f64 x0[STREAM_BATCH] __attribute__((aligned(PAIRS_ALIGN)));
+  f64 y0[STREAM_BATCH] __attribute__((aligned(PAIRS_ALIGN)));
+  f64 x1[STREAM_BATCH] __attribute__((aligned(PAIRS_ALIGN)));
+  f64 y1[STREAM_BATCH] __attribute__((aligned(PAIRS_ALIGN)));
+  f64 values[STREAM_BATCH] __attribute__((aligned(PAIRS_ALIGN)));
+};
+
+static void stream_flush(struct stream_state *state) {
+  haversine_kernels[state->tier](state->x0, state->y0, state->x1, state->y1, state->values, state->batch_len);
+  sum_acc_add(&state->block, state->sum_mode, sum_batch(state->sum_mode, state->values, state->batch_len));
+  if (state->reference) {
+    sum_reference_add(&state->reference_sum, state->values, state->batch_len);
+  }
+  state->batch_len = 0;
+
+  if (state->pairs_len % SUM_BLOCK == 0) {
+    sum_acc_add(&state->total, state->sum_mode, sum_acc_result(&state->block, state->sum_mode));
+    state->block = (struct sum_acc){0};
+  }
+}
+
+// The scan helpers below advance *i and return 0 when they run out of bytes.
+
+static inline b32 stream_peek(char *bytes, u64 size, u64 *i, char *c) {
+  while (*i < size && isspace(bytes[*i])) {
+    (*i)++;
+  }
+
+  if (*i == size) {
+    return 0;
+  }
+
+  *c = bytes[*i];
+  return 1;
+}
+
+static inline b32 stream_char(char *bytes, u64 size, u64 *i, char expected) {
+  char c;
+  if (!stream_peek(bytes, size, i, &c)) {
+    return 0;
+  }
+
+  assert(c == expected);
+  (*i)++;
+  return 1;
+}
+
+static inline b32 stream_key(char *bytes, u64 size, u64 *i, char **key, u64 *key_len) {
+  if (!stream_char(bytes, size, i, '"')) {
+    return 0;
+  }
+
+  u64 start = *i;
+  while (*i < size && isalnum(bytes[*i])) {
+    (*i)++;
+  }
+
+  *key = bytes + start;
+  *key_len = *i - start;
+  return stream_char(bytes, size, i, '"');
+}
+
+static inline b32 stream_number(char *bytes, u64 size, u64 *i, f64 *number) {
+  char c;
+  if (!stream_peek(bytes, size, i, &c)) {
+    return 0;
+  }
+
+  assert(isdigit(c) || c == '-');
+
+  // A number touching the end of the buffer may continue in the next one.
+  u64 end = parse_f64(bytes, size, *i, number);
+  if (end == size) {
+    return 0;
+  }
+
+  *i = end;
+  return 1;
+}
+
+static b32 stream_object(char *bytes, u64 size, u64 *i, pair p, struct template_stats *templates) {
+  char c;
+  if (!stream_peek(bytes, size, i, &c)) {
+    return 0;
+  }
+
+  u64 end = pair_template(bytes, size, *i, p);
+  if (end) {
+    templates->hits++;
+    *i = end;
+    return 1;
+  }
+
+  // Only counted once the object is complete, a miss because the buffer ran
+  // out is retried when there is more.
+  if (!stream_char(bytes, size, i, '{')) {
+    return 0;
+  }
+
+  u32 seen = 0;
+  for (u32 j = 0; j < 4; j++) {
+    if (j != 0 && !stream_char(bytes, size, i, ',')) {
+      return 0;
+    }
+
+    char *key;
+    u64 key_len;
+    if (!stream_key(bytes, size, i, &key, &key_len)) {
+      return 0;
+    }
+
+    assert(key_len == 2);
+    u32 index = ident2index(key);
+    assert(index < 4);
+
+    if (!stream_char(bytes, size, i, ':') || !stream_number(bytes, size, i, &p[index])) {
+      return 0;
+    }
+
+    seen |= 1 << index;
+  }
+
+  assert(seen == 0xf);
+  if (!stream_char(bytes, size, i, '}')) {
+    return 0;
+  }
+
+  templates->misses++;
+  return 1;
+}
+
+// Returns the number of bytes consumed, anything after that is an incomplete
+// step that has to be fed again once more bytes are available.
+u64 stream_feed(struct stream_state *state, char *bytes, u64 size) {
+  u64 i = 0;
+
+  for (;;) {
+    u64 j = i;
+    char c;
+
+    switch (state->phase) {
+      case STREAM_OPEN:
+        if (!stream_char(bytes, size, &j, '{')) {
+          return i;
+        }
+        state->phase = STREAM_KEY;
+        break;
+      case STREAM_KEY:
+        {
+          char *key;
+          u64 key_len;
+          if (!stream_key(bytes, size, &j, &key, &key_len) || !stream_char(bytes, size, &j, ':')) {
+            return i;
+          }
+
+          if (key_len == 8 && memcmp(key, "expected", 8) == 0) {
+            if (!stream_number(bytes, size, &j, &state->expected)) {
+              return i;
+            }
+            state->phase = STREAM_NEXT;
+          } else {
+            assert(key_len == 5 && memcmp(key, "pairs", 5) == 0);
+            if (!stream_char(bytes, size, &j, '[')) {
+              return i;
+            }
+            state->phase = STREAM_PAIRS_FIRST;
+          }
+        }
+        break;
+      case STREAM_PAIRS_FIRST:
+      case STREAM_PAIRS_NEXT:
+        {
+          // Someone else is going to handle the array itself.
+          if (state->stop_at_pairs) {
+            return i;
+          }
+
+          if (!stream_peek(bytes, size, &j, &c)) {
+            return i;
+          }
+
+          if (c == ']') {
+            j++;
+            state->phase = STREAM_NEXT;
+            break;
+          }
+
+          if (state->phase == STREAM_PAIRS_NEXT) {
+            assert(c == ',');
+            j++;
+          }
+
+          pair p;
+          if (!stream_object(bytes, size, &j, p, &state->templates)) {
+            return i;
+          }
+
+          u32 k = state->batch_len++;
+          state->x0[k] = p[0];
+          state->y0[k] = p[1];
+          state->x1[k] = p[2];
+          state->y1[k] = p[3];
+          state->pairs_len++;
+
+          if (state->batch_len == STREAM_BATCH) {
+            stream_flush(state);
+          }
+          state->phase = STREAM_PAIRS_NEXT;
+        }
+        break;
+      case STREAM_NEXT:
+        if (!stream_peek(bytes, size, &j, &c)) {
+          return i;
+        }
+
+        j++;
+        if (c == '}') {
+          state->phase = STREAM_DONE;
+        } else {
+          assert(c == ',');
+          state->phase = STREAM_KEY;
+        }
+        break;
+      case STREAM_DONE:
+        stream_peek(bytes, size, &j, &c);
+        assert(j == size);
+        return j;
+    }
+
+    i = j;
+  }
+}
+
+void stream_input(char *filename, enum read_mode read_mode, u32 depth, struct stream_state *state) {
+  if (read_mode == READ_MMAP_WINDOW) {
+    // Out of core: only a few steps of the file are ever resident.
+    struct input_window window = open_input_window(filename);
+    {
+      PROF_BANDWIDTH("stream", window.size);
+      while (window.cursor < window.size) {
+        u64 len = input_window_len(&window);
+        u64 consumed = stream_feed(state, window.bytes + window.cursor, len);
+        if (consumed == 0 || (window.cursor + len == window.size && consumed != len)) {
+          fprintf(stderr, "Malformed or truncated input in %s\n", filename);
+          exit(1);
+        }
+
+        input_window_advance(&window, consumed);
+      }
+    }
+    close_input_window(&window);
+  } else if (read_mode != READ_FREAD) {
+    struct input_file file = read_file(filename, read_mode);
+    {
+      PROF_BANDWIDTH("stream", file.size);
+      stream_feed(state, file.bytes, file.size);
+    }
+    free_input_file(&file);
+  } else if (depth > 0) {
+    // Bounded memory as well, but the next chunks are read while this one is
+    // parsed.
+    struct input_ring *ring = open_input_ring(filename, depth);
+    {
+      PROF_BANDWIDTH("stream", ring->size);
+      u64 len = 0;
+      char *bytes = input_ring_next(ring, NULL, 0, &len);
+      for (;;) {
+        u64 consumed = stream_feed(state, bytes, len);
+        if (ring->eof) {
+          if (consumed != len) {
+            fprintf(stderr, "Malformed or truncated input in %s\n", filename);
+            exit(1);
+          }
+          break;
+        }
+
+        bytes = input_ring_next(ring, bytes + consumed, len - consumed, &len);
+      }
+    }
+    close_input_ring(ring);
+  } else {
+    // Bounded memory: the only buffer is the fixed size stream window.
+    struct input_stream stream = open_input_stream(filename);
+    {
+      PROF_BANDWIDTH("stream", stream.size);
+      for (;;) {
+        u64 consumed = stream_feed(state, stream.buffer, stream.len);
+        if (stream.eof && consumed == stream.len) {
+          break;
+        }
+
+        if (consumed == 0 && (stream.eof || stream.len == stream.cap)) {
+          fprintf(stderr, "Malformed or truncated input in %s\n", filename);
+          exit(1);
+        }
+
+        input_stream_advance(&stream, consumed);
+      }
+    }
+    close_input_stream(&stream);
+  }
+
+  assert(state->phase == STREAM_DONE);
+
+  if (state->batch_len) {
+    stream_flush(state);
+  }
+  if (state->block.count) {
+    sum_acc_add(&state->total, state->sum_mode, sum_acc_result(&state->block, state->sum_mode));
+    state->block = (struct sum_acc){0};
+  }
+
+  struct sum_part total = sum_acc_result(&state->total, state->sum_mode);
+  state->sum = total.sum + total.c;
+}
+
+/*******************************************************************************
+ * Parallel parse
+ *
+ * The pairs array, up to the last ']' in the document, is split into one
+ * chunk per thread. The first chunk starts on the array's first object, and
+ * every other one resyncs on the first `{"x0"` that starts inside its nominal
+ * range. Each parses objects, whatever their key order or spacing, until it
+ * reaches the point where the next chunk resynced, into its own columns.
+ * Chunks with no sync point, which is most of them once there are more chunks
+ * than pairs, are empty and their range is folded into the one before them.
+ * The document around the array goes through the streaming scanner on the
+ * main thread, and afterwards every chunk must have stopped exactly where the
+ * next one started, with only the last one seeing the closing ']'.
+ */
+
+struct parse_chunk {
+  u64 start;
+  u64 end;
+  u64 stop;
+  b32 closed;
+  struct json_input pairs;
+  struct template_stats templates;
+  u64 offset;
+} __attribute__((aligned(64)));
+
+struct parse_job {
+  char *bytes;
+  u64 size;
+  struct parse_chunk *chunks;
+  struct json_input *input;
+};
+
+static inline void json_input_push(struct json_input *input, pair p) {
+  if (input->pairs_len == input->pairs_cap) {
+    json_input_reserve(input, input->pairs_cap << 1);
+  }
+
+  input->x0[input->pairs_len] = p[0];
+  input->y0[input->pairs_len] = p[1];
+  input->x1[input->pairs_len] = p[2];
+  input->y1[input->pairs_len] = p[3];
+  input->pairs_len++;
+}
+
+static void parse_chunk_task(void *ctx, u32 thread_index, u32 thread_count) {
+  struct parse_job *job = ctx;
+  struct parse_chunk *chunk = &job->chunks[thread_index];
+  char *bytes = job->bytes;
+  u64 size = job->size;
+
+  if (chunk->start == chunk->end) {
+    return;
+  }
+
+  PROF_BANDWIDTH("parse:chunk", chunk->end - chunk->start);
+
+  // Generated objects are ~70 bytes, so this rarely has to grow.
+  json_input_reserve(&chunk->pairs, (chunk->end - chunk->start) / 64 + 16);
+
+  u64 i = chunk->start;
+  char c;
+  b32 ok = stream_peek(bytes, size, &i, &c);
+  assert(ok);
+
+  if (c == ']') {
+    chunk->closed = 1;
+    i++;
+  } else {
+    for (;;) {
+      pair p;
+      ok = stream_object(bytes, size, &i, p, &chunk->templates);
+      assert(ok);
+      json_input_push(&chunk->pairs, p);
+
+      ok = stream_peek(bytes, size, &i, &c);
+      assert(ok);
+      i++;
+
+      if (c == ']') {
+        chunk->closed = 1;
+        break;
+      }
+
+      assert(c == ',');
+      ok = stream_peek(bytes, size, &i, &c);
+      assert(ok);
+
+      if (i >= chunk->end) {
+        break;
+      }
+    }
+  }
+
+  chunk->stop = i;
+}
+
+static void parse_merge_task(void *ctx, u32 thread_index, u32 thread_count) {
+  struct parse_job *job = ctx;
+  struct parse_chunk *chunk = &job->chunks[thread_index];
+  struct json_input *input = job->input;
+  u64 n = chunk->pairs.pairs_len;
+
+  // Chunks that never ran have no columns at all.
+  if (n) {
+    memcpy(input->x0 + chunk->offset, chunk->pairs.x0, sizeof(f64) * n);
+    memcpy(input->y0 + chunk->offset, chunk->pairs.y0, sizeof(f64) * n);
+    memcpy(input->x1 + chunk->offset, chunk->pairs.x1, sizeof(f64) * n);
+    memcpy(input->y1 + chunk->offset, chunk->pairs.y1, sizeof(f64) * n);
+  }
+  free_json_input(&chunk->pairs);
+}
+
+struct json_input parse_parallel(char *bytes, u64 size, struct pool *pool, struct template_stats *templates) {
+  PROF_BANDWIDTH(__func__, size);
+
+  // Everything up to and including the '[' of the pairs array.
+  struct stream_state *state = calloc(1, sizeof(struct stream_state));
+  state->phase = STREAM_OPEN;
+  state->stop_at_pairs = 1;
+  u64 pairs_start = stream_feed(state, bytes, size);
+  assert(state->phase == STREAM_PAIRS_FIRST);
+
+  u32 count = pool->count;
+  struct parse_chunk *chunks = aligned_alloc(64, sizeof(struct parse_chunk) * count);
+  memset(chunks, 0, sizeof(struct parse_chunk) * count);
+
+  // The array closes at or before the last ']' in the document, so nothing
+  // past that is split up or searched.
+  char *close = memrchr(bytes + pairs_start, ']', size - pairs_start);
+  u64 pairs_end = close != NULL ? (u64)(close - bytes) : size;
+  u64 span = pairs_end - pairs_start;
+
+  // Chunk 0 starts on the first byte after the whitespace following '[',
+  // whatever its first object looks like, so no other chunk can resync onto
+  // that object as well. `{"x0"` only places the boundaries after it.
+  u64 first = pairs_start;
+  char c;
+  stream_peek(bytes, size, &first, &c);
+  chunks[0].start = first;
+
+  // A sync point has to start inside the chunk's own range. Without one the
+  // chunk is empty, and its start stays 0.
+  for (u32 t = 1; t < count; t++) {
+    u64 nominal = pairs_start + span * t / count;
+    u64 next = pairs_start + span * (t + 1) / count;
+    u64 limit = next + 4 < pairs_end ? next + 4 : pairs_end;
+    char *sync = nominal < limit ? memmem(bytes + nominal, limit - nominal, "{\"x0\"", 5) : NULL;
+    if (sync != NULL && (u64)(sync - bytes) > chunks[0].start) {
+      chunks[t].start = (u64)(sync - bytes);
+    }
+  }
+
+  // Empty chunks hand their range to the previous non-empty one.
+  u64 end = size;
+  for (u32 t = count; t-- > 0;) {
+    b32 empty = t > 0 && chunks[t].start == 0;
+    if (empty) {
+      chunks[t].start = chunks[t].end = end;
+    } else {
+      chunks[t].end = end;
+      end = chunks[t].start;
+    }
+  }
+
+  struct parse_job job = {
+    .bytes = bytes,
+    .size = size,
+    .chunks = chunks,
+  };
+  pool_run(pool, parse_chunk_task, &job);
+
+  // The chunks have to tile the array exactly.
+  u64 total = 0;
+  u64 array_end = 0;
+  for (u32 t = 0; t < count; t++) {
+    struct parse_chunk *chunk = &chunks[t];
+    if (chunk->start == chunk->end) {
+      continue;
+    }
+
+    assert(!array_end);
+    if (chunk->closed) {
+      array_end = chunk->stop;
+    } else {
+      assert(chunk->stop == chunk->end);
+    }
+
+    chunk->offset = total;
+    total += chunk->pairs.pairs_len;
+    templates->hits += chunk->templates.hits;
+    templates->misses += chunk->templates.misses;
+  }
+  assert(array_end);
+
+  struct json_input input = {0};
+  json_input_reserve(&input, total);
+  input.pairs_len = total;
+  job.input = &input;
+  pool_run(pool, parse_merge_task, &job);
+
+  // And whatever comes after it, which is where "expected" usually is.
+  state->phase = STREAM_NEXT;
+  stream_feed(state, bytes + array_end, size - array_end);
+  assert(state->phase == STREAM_DONE);
+  input.expected = state->expected;
+
+  free(state);
+  free(chunks);
+  return input;
+}
+
+void print_templates(struct template_stats *templates) {
+  u64 objects = templates->hits + templates->misses;
+  if (objects) {
+    printf("template = %"PRIu64" of %"PRIu64" objects (%.2f%%)\n",
+        templates->hits, objects, 100.0 * (f64)templates->hits / (f64)objects);
+  }
+}
+
+// Each mode is held against the exact sum of the very values it summed, so the
+// difference is its reduction error alone. `expected` is no use for this: the
+// generator computed it before the coordinates went through %f, and that
+// rounding is far bigger than anything the reduction does.
+void print_sum(enum sum_mode mode, f64 average, f64 reference, u64 bytes, u64 us) {
+  printf("sum      = %-8s %18.9f, %+.3e from exact", sum_mode_names[mode], average, average - reference);
+  if (us) {
+    printf(", %.2fgb/s", (f64)bytes / ((f64)us * 1e-6) / (1024.0 * 1024.0 * 1024.0));
+  }
+  printf("\n");
+}
+
+void usage(void) {
+  fprintf(stderr, "Usage: haversine [-c] [-f | -p] [-j threads] [-q depth] [-r fread|mmap|hugepage|window] [-a libm|full|fast|faster]\n"
+      "                 [--validate answers.f64 [--tolerance km]]\n"
+      "                 [--sum naive|kahan|pairwise|all] [--trace out.json] filename|-\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  PROF_INIT();
+
+  enum read_mode read_mode = READ_FREAD;
+  enum math_tier tier = MATH_LIBM;
+  b32 cached = 0;
+  b32 fused = 0;
+  b32 parallel = 0;
+  u32 threads = 1;
+  u32 depth = 4;
+  char *answers_name = NULL;
+  f64 tolerance = 1e-9;
+  enum sum_mode sum_mode = SUM_NAIVE;
+  b32 sum_all = 0;
+  b32 sum_report = 0;
+
+  enum {
+    OPT_VALIDATE = 256,
+    OPT_TOLERANCE,
+    OPT_SUM,
+    OPT_TRACE,
+  };
+  struct option long_options[] = {
+    { "validate", required_argument, NULL, OPT_VALIDATE },
+    { "tolerance", required_argument, NULL, OPT_TOLERANCE },
+    { "sum", required_argument, NULL, OPT_SUM },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { NULL, 0, NULL, 0 },
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "a:cfj:pq:r:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'a':
+        if (!parse_math_tier(optarg, &tier)) {
+          fprintf(stderr, "Unknown accuracy tier: %s\n", optarg);
+          usage();
+        }
+        break;
+      case 'c':
+        cached = 1;
+        break;
+      case 'f':
+        fused = 1;
+        break;
+      case 'j':
+        threads = (u32)atoi(optarg);
+        break;
+      case 'p':
+        parallel = 1;
+        break;
+      case 'q':
+        depth = (u32)atoi(optarg);
+        break;
+      case 'r':
+        if (!parse_read_mode(optarg, &read_mode)) {
+          fprintf(stderr, "Unknown read mode: %s\n", optarg);
+          usage();
+        }
+        break;
+      case OPT_VALIDATE:
+        answers_name = optarg;
+        break;
+      case OPT_TOLERANCE:
+        tolerance = atof(optarg);
+        break;
+      case OPT_SUM:
+        sum_all = strcmp(optarg, "all") == 0;
+        if (!sum_all && !parse_sum_mode(optarg, &sum_mode)) {
+          fprintf(stderr, "Unknown sum mode: %s\n", optarg);
+          usage();
+        }
+        sum_report = 1;
+        break;
+      case OPT_TRACE:
+        prof_trace(optarg);
+        break;
+      default:
+        usage();
+    }
+  }
+
+  if (optind != argc - 1) {
+    usage();
+  }
+
+  if (fused && answers_name != NULL) {
+    fprintf(stderr, "--validate needs the pairs in memory, it does not work with -f\n");
+    exit(1);
+  }
+
+  // Pipes and stdin can only go through the bounded stream.
+  b32 piped = !input_is_regular(argv[optind]);
+  if (piped) {
+    if (parallel || cached || answers_name != NULL) {
+      fprintf(stderr, "-p, -c and --validate need a regular file\n");
+      exit(1);
+    }
+    fused = 1;
+    read_mode = READ_FREAD;
+  }
+
+  // Binary files are always mapped, their columns are used in place.
+  b32 binary = !piped && is_pairs_file(argv[optind]);
+  if (binary && (read_mode == READ_FREAD || read_mode == READ_MMAP_WINDOW)) {
+    read_mode = READ_MMAP;
+  }
+
+  // Out of core only works one pair at a time, which is the fused path.
+  if (read_mode == READ_MMAP_WINDOW) {
+    if (parallel || cached || answers_name != NULL) {
+      fprintf(stderr, "-p, -c and --validate need the input in memory, they do not work with -r window\n");
+      exit(1);
+    }
+    fused = 1;
+  }
+
+  if (fused && !binary && sum_all) {
+    fprintf(stderr, "--sum all needs the pairs in memory, it does not work with -f, -r window or pipes\n");
+    exit(1);
+  }
+
+  if (fused && !binary) {
+    struct stream_state state = {
+      .phase = STREAM_OPEN,
+      .tier = tier,
+      .sum_mode = sum_mode,
+      .reference = sum_report,
+    };
+    stream_input(argv[optind], read_mode, depth, &state);
+
+    f64 average = state.sum/(f64)state.pairs_len;
+    printf("expected = %12.6f\nactual   = %12.6f\n", state.expected, average);
+    if (sum_report) {
+      print_sum(sum_mode, average, sum_reference_result(&state.reference_sum)/(f64)state.pairs_len, 0, 0);
+    }
+    print_templates(&state.templates);
+    return 0;
+  }
+
+  struct pool pool;
+  pool_init(&pool, threads);
+
+  struct input_file file = {0};
+  struct tokens tokens = {0};
+  struct symbols symbols;
+  struct template_stats templates = {0};
+  struct json_input input;
+
+  init_symbols(&symbols);
+
+  char *cache = NULL;
+  struct cache_key key = {0};
+  b32 cache_hit = 0;
+  s64 cache_saved_us = 0;
+
+  if (cached && !binary) {
+    PROF_BLOCK("cache:lookup");
+    u64 start = prof_read_os_timer();
+    cache = cache_name(argv[optind]);
+    key = cache_key(argv[optind]);
+    u64 parse_us = 0;
+    cache_hit = cache_load(cache, &key, &file, &input, &parse_us);
+    if (cache_hit) {
+      cache_saved_us = (s64)parse_us - (s64)(prof_read_os_timer() - start);
+    }
+  }
+
+  if (!cache_hit) {
+    u64 start = prof_read_os_timer();
+    file = read_file(argv[optind], read_mode);
+
+    if (binary) {
+      input = load_pairs(&file);
+    } else if (parallel) {
+      input = parse_parallel(file.bytes, file.size, &pool, &templates);
+    } else {
+      tokens = lex(file.bytes, file.size, &symbols);
+      input = parse(&tokens);
+      templates = tokens.templates;
+    }
+
+    if (cache != NULL) {
+      cache_store(cache, &key, &input, prof_read_os_timer() - start);
+    }
+  }
+
+  struct validation validation = {
+    .tolerance = tolerance,
+  };
+
+  if (answers_name != NULL) {
+    validation.answers = open_input_window(answers_name);
+    if (validation.answers.size != input.pairs_len * sizeof(f64)) {
+      fprintf(stderr, "%s has %"PRIu64" answers for %"PRIu64" pairs\n", answers_name, validation.answers.size / sizeof(f64), input.pairs_len);
+      exit(1);
+    }
+  }
+
+  f64 sum = sum_pairs(&input, tier, sum_mode, &pool, answers_name ? &validation : NULL);
+  f64 average = sum/(f64)input.pairs_len;
+  printf("expected = %12.6f\nactual   = %12.6f\n", input.expected, average);
+
+  f64 reference = sum_report ? reference_pairs(&input, tier)/(f64)input.pairs_len : 0;
+
+  if (sum_all) {
+    // Timed again without validation, and after the run above has warmed up
+    // the columns, so the modes only differ in how they reduce.
+    for (u32 m = 0; m < SUM_MODE_COUNT; m++) {
+      u64 start = prof_read_os_timer();
+      f64 mode_sum = sum_pairs(&input, tier, (enum sum_mode)m, &pool, NULL);
+      u64 us = prof_read_os_timer() - start;
+      print_sum((enum sum_mode)m, mode_sum/(f64)input.pairs_len, reference, input.pairs_len * sizeof(pair), us);
+    }
+  } else if (sum_report) {
+    print_sum(sum_mode, average, reference, 0, 0);
+  }
+
+  if (answers_name != NULL) {
+    printf("validate = %"PRIu64" of %"PRIu64" pairs off by more than %gkm (max %.3gkm)\n",
+        validation.over, input.pairs_len, validation.tolerance, validation.max_error);
+    for (u32 i = 0; i < validation.worst_len; i++) {
+      struct validate_offender *worst = &validation.worst[i];
+      printf("  pair %"PRIu64": %.12f want %.12f (%.3gkm)\n",
+          worst->index, worst->value, worst->answer, fabs(worst->value - worst->answer));
+    }
+    close_input_window(&validation.answers);
+  }
+
+  if (cache != NULL) {
+    if (cache_hit) {
+      printf("cache    = hit, %.2fms saved\n", (f64)cache_saved_us / 1000.0);
+    } else {
+      printf("cache    = miss, wrote %s\n", cache);
+    }
+    free(cache);
+  }
+
+  print_templates(&templates);
+
+  if (tokens.types != NULL && file.size) {
+    // Memory per byte of JSON, to see what a GB of input costs.
+    u64 pairs_bytes = input.pairs_len * sizeof(pair);
+    printf("tokens   = %"PRIu64", %.3f bytes per input byte (pairs %.3f)\n",
+        tokens.len, (f64)tokens_bytes(&tokens) / (f64)file.size, (f64)pairs_bytes / (f64)file.size);
+  }
+
+  {
+    PROF_BANDWIDTH("cleanup", (file.size) + (input.pairs_len * sizeof(pair)) + tokens_bytes(&tokens));
+    free_input_file(&file);
+    free_json_input(&input);
+    free_tokens(&tokens);
+    free_symbols(&symbols);
+  }
+
+  pool_destroy(&pool);
+  return 0;
+}
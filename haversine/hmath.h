@@ -0,0 +1,430 @@
+#ifndef __HMATH_H__
+#define __HMATH_H__
+
+#include <math.h>
+#include <string.h>
+
+#include "shared.h"
+
+#define EARTH_RADIUS_KM 6372.8
+#define square(x) ((x)*(x))
+#define deg2rad(d) (0.01745329251994329577*(d))
+
+#define HMATH_PI 3.14159265358979323846
+#define HMATH_HALF_PI 1.57079632679489661923
+
+// Reference formula, straight libm.
+static inline f64 haversine(f64 x0, f64 y0, f64 x1, f64 y1) {
+  f64 dy = deg2rad(y1-y0);
+  f64 dx = deg2rad(x1-x0);
+  f64 ry0 = deg2rad(y0);
+  f64 ry1 = deg2rad(y1);
+
+  f64 a = square(sin(dy/2.0)) + cos(ry0)*cos(ry1)*square(sin(dx/2.0));
+  f64 c = 2.0*asin(sqrt(a));
+
+  return EARTH_RADIUS_KM * c;
+}
+
+/*******************************************************************************
+ * Approximations
+ *
+ * Only the ranges the formula actually produces are covered: sin sees half
+ * angle differences in [-pi, pi], cos sees latitudes in [-pi/2, pi/2] and asin
+ * sees sqrt(a) in [0, 1]. Everything is straight-line code with selects
+ * instead of branches so the kernels below vectorize. sqrt is left alone, it
+ * is a single exact instruction already.
+ *
+ * Both polynomials are Chebyshev fits of the series remainder, which are close
+ * to minimax:
+ *   sin(x)  = x + x^3 S(x^2)  for |x| <= pi/2
+ *   asin(x) = x + x^3 A(x^2)  for 0 <= x <= 1/2
+ * and asin(x) = pi/2 - 2 asin(sqrt((1 - x)/2)) above 1/2. The number of terms
+ * sets the tier; `bench math` reports the errors each one actually gets.
+ *
+ * The folds subtract from a rounded pi, so close to the zeros of sin and cos
+ * the relative (ulp) error is large, which the formula does not care about
+ * since those terms get squared or multiplied.
+ *
+ * What a tier gives per call is not what it gives per distance. Near
+ * antipodal points sqrt(a) is close to 1, where asin's slope is unbounded, so
+ * an error e in `a` grows towards sqrt(e) in the angle. Measured end to end
+ * over uniformly random pairs (`bench math`), against libm:
+ *
+ *   tier    per call (sin/cos, asin)   haversine max abs   max rel
+ *   full    8e-16, 3e-16               6e-8km              3e-12
+ *   fast    1.1e-10, 6e-11             1.4e-2km            7e-7
+ *   faster  2.7e-8, 3.3e-7             1.3km               6.4e-5
+ *
+ * The averages these feed are far tighter than the worst pair, but a caller
+ * that needs a bound per distance should use full or libm.
+ */
+
+enum math_tier {
+  MATH_LIBM,
+  MATH_FULL,
+  MATH_FAST,
+  MATH_FASTER,
+
+  MATH_TIER_COUNT,
+};
+
+const char *math_tier_names[MATH_TIER_COUNT] = {
+  [MATH_LIBM] = "libm",
+  [MATH_FULL] = "full",
+  [MATH_FAST] = "fast",
+  [MATH_FASTER] = "faster",
+};
+
+b32 parse_math_tier(const char *name, enum math_tier *tier) {
+  for (u32 i = 0; i < MATH_TIER_COUNT; i++) {
+    if (strcmp(name, math_tier_names[i]) == 0) {
+      *tier = (enum math_tier)i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static const f64 hmath_sin_full[8] = {
+  -0.16666666666666619, 0.008333333333317362, -0.00019841269831801615,
+  2.75573170785003e-06, -2.5051874731292553e-08, 1.6045884816734354e-10,
+  -7.276928034109764e-13, -1.330873623796243e-15,
+};
+
+static const f64 hmath_sin_fast[5] = {
+  -0.1666666666388123, 0.00833333276875319, -0.00019841086561412933,
+  2.7536463558667e-06, -2.408019035811403e-08,
+};
+
+static const f64 hmath_sin_faster[4] = {
+  -0.16666665963821187, 0.008333242135097101, -0.00019822739488653448,
+  2.6347563918787108e-06,
+};
+
+static const f64 hmath_asin_full[12] = {
+  0.16666666666666619, 0.07500000000033454, 0.04464285708789133,
+  0.030381948265290084, 0.022372019451190175, 0.017355781895491203,
+  0.013923635686890016, 0.011919820619862803, 0.0075943107283766315,
+  0.016642427652531454, -0.011742878312949524, 0.028869830208183622,
+};
+
+static const f64 hmath_asin_fast[7] = {
+  0.1666666668608567, 0.07499992404392397, 0.044647663892408776,
+  0.030269138658583526, 0.023611817530292494, 0.010574413714699844,
+  0.030974542720546863,
+};
+
+static const f64 hmath_asin_faster[4] = {
+  0.1666656226589153, 0.07513281002217587, 0.042074866793162656,
+  0.04546544910822169,
+};
+
+// x + x^3 P(x^2), with n a constant once inlined so the loop unrolls.
+static inline f64 hmath_odd_poly(f64 x, const f64 *c, u32 n) {
+  f64 t = x*x;
+  f64 p = c[n-1];
+  for (u32 i = n-1; i-- > 0;) {
+    p = p*t + c[i];
+  }
+  return x + x*t*p;
+}
+
+// |x| <= pi, folded into [-pi/2, pi/2] with sin(x) = sin(pi - x).
+static inline f64 hmath_sin(f64 x, const f64 *c, u32 n) {
+  f64 ax = fabs(x);
+  f64 r = ax > HMATH_HALF_PI ? HMATH_PI - ax : ax;
+  return copysign(hmath_odd_poly(r, c, n), x);
+}
+
+// |x| <= pi/2, as sin(pi/2 - |x|).
+static inline f64 hmath_cos(f64 x, const f64 *c, u32 n) {
+  return hmath_odd_poly(HMATH_HALF_PI - fabs(x), c, n);
+}
+
+// 0 <= x <= 1, rounding can push sqrt(a) a hair past 1 so it is clamped.
+static inline f64 hmath_asin(f64 x, const f64 *c, u32 n) {
+  x = x < 1.0 ? x : 1.0;
+  b32 big = x > 0.5;
+  f64 s = big ? sqrt((1.0 - x)*0.5) : x;
+  f64 r = hmath_odd_poly(s, c, n);
+  return big ? HMATH_HALF_PI - 2.0*r : r;
+}
+
+#define HMATH_ARGS(c) c, sizeof(c)/sizeof(c[0])
+
+#define HAVERSINE_APPROX(tier) \
+  static inline f64 sin_##tier(f64 x) { return hmath_sin(x, HMATH_ARGS(hmath_sin_##tier)); } \
+  static inline f64 cos_##tier(f64 x) { return hmath_cos(x, HMATH_ARGS(hmath_sin_##tier)); } \
+  static inline f64 asin_##tier(f64 x) { return hmath_asin(x, HMATH_ARGS(hmath_asin_##tier)); } \
+  static inline f64 haversine_##tier(f64 x0, f64 y0, f64 x1, f64 y1) { \
+    f64 dy = deg2rad(y1-y0); \
+    f64 dx = deg2rad(x1-x0); \
+    f64 ry0 = deg2rad(y0); \
+    f64 ry1 = deg2rad(y1); \
+    f64 a = square(sin_##tier(dy/2.0)) + cos_##tier(ry0)*cos_##tier(ry1)*square(sin_##tier(dx/2.0)); \
+    f64 c = 2.0*asin_##tier(sqrt(a)); \
+    return EARTH_RADIUS_KM * c; \
+  }
+
+HAVERSINE_APPROX(full)
+HAVERSINE_APPROX(fast)
+HAVERSINE_APPROX(faster)
+
+/*******************************************************************************
+ * Kernels
+ *
+ * Pairs are stored as one 64-byte aligned column per coordinate so a kernel
+ * can load a full vector of each straight from memory. The loops are written
+ * scalar and left to the vectorizer: the clones give 8 pairs per iteration on
+ * AVX-512 and 4 on AVX2, picked at load time. The libm tier only vectorizes
+ * through libmvec (-ffast-math), the approximations vectorize on their own.
+ *
+ * Kernels write one distance per pair into a small aligned batch rather than
+ * summing as they go, and sum_f64() reduces the batch. The batch stays in L1,
+ * so this costs next to nothing, and callers that want the distances
+ * themselves (validation) get them from the same code that produces the sum.
+ */
+
+#define PAIRS_ALIGN 64
+
+#define HAVERSINE_KERNEL(tier, fn) \
+  __attribute__((target_clones("avx512f", "avx2", "default"))) \
+  void haversine_batch_##tier(const f64 *restrict x0, const f64 *restrict y0, \
+      const f64 *restrict x1, const f64 *restrict y1, f64 *restrict out, u64 count) { \
+    x0 = __builtin_assume_aligned(x0, PAIRS_ALIGN); \
+    y0 = __builtin_assume_aligned(y0, PAIRS_ALIGN); \
+    x1 = __builtin_assume_aligned(x1, PAIRS_ALIGN); \
+    y1 = __builtin_assume_aligned(y1, PAIRS_ALIGN); \
+    out = __builtin_assume_aligned(out, PAIRS_ALIGN); \
+    for (u64 i = 0; i < count; i++) { \
+      out[i] = fn(x0[i], y0[i], x1[i], y1[i]); \
+    } \
+  }
+
+HAVERSINE_KERNEL(libm, haversine)
+HAVERSINE_KERNEL(full, haversine_full)
+HAVERSINE_KERNEL(fast, haversine_fast)
+HAVERSINE_KERNEL(faster, haversine_faster)
+
+typedef void haversine_kernel(const f64 *restrict, const f64 *restrict,
+    const f64 *restrict, const f64 *restrict, f64 *restrict, u64);
+
+haversine_kernel *haversine_kernels[MATH_TIER_COUNT] = {
+  [MATH_LIBM] = haversine_batch_libm,
+  [MATH_FULL] = haversine_batch_full,
+  [MATH_FAST] = haversine_batch_fast,
+  [MATH_FASTER] = haversine_batch_faster,
+};
+
+__attribute__((target_clones("avx512f", "avx2", "default")))
+f64 sum_f64(const f64 *restrict values, u64 count) {
+  values = __builtin_assume_aligned(values, PAIRS_ALIGN);
+  f64 sum = 0;
+  for (u64 i = 0; i < count; i++) {
+    sum += values[i];
+  }
+  return sum;
+}
+
+/*******************************************************************************
+ * Reductions
+ *
+ * How a run of distances becomes one number. Every mode keeps SUM_LANES
+ * independent accumulators per batch, the way the vectorizer would split a
+ * naive loop anyway, so none of them costs much more than a plain sum:
+ *
+ *   naive     plain running sums, error grows with the count.
+ *   kahan     Neumaier's variant of compensated summation. Each lane carries
+ *             the exact rounding error of its adds, found with Knuth's branch
+ *             free two-sum so the lanes vectorize, and partial results stay
+ *             an unevaluated (sum, c) pair until the very end.
+ *   pairwise  a balanced tree: batches are split in halves down to
+ *             SUM_PAIRWISE_LEAF values, and partials are combined through a
+ *             binary counter, so the error grows with log2 of the count.
+ *
+ * The compensated and pairwise code must be evaluated exactly as written,
+ * which -ffast-math (release builds) would not do: reassociating Neumaier's
+ * correction turns it into a constant zero. Those functions opt out of it.
+ */
+
+#define SUM_LANES 8
+#define SUM_PAIRWISE_LEAF 128
+#define SUM_PAIRWISE_DEPTH 64
+
+enum sum_mode {
+  SUM_NAIVE,
+  SUM_KAHAN,
+  SUM_PAIRWISE,
+
+  SUM_MODE_COUNT,
+};
+
+const char *sum_mode_names[SUM_MODE_COUNT] = {
+  [SUM_NAIVE] = "naive",
+  [SUM_KAHAN] = "kahan",
+  [SUM_PAIRWISE] = "pairwise",
+};
+
+b32 parse_sum_mode(const char *name, enum sum_mode *mode) {
+  for (u32 i = 0; i < SUM_MODE_COUNT; i++) {
+    if (strcmp(name, sum_mode_names[i]) == 0) {
+      *mode = (enum sum_mode)i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A partial result. Only kahan ever has a non-zero c, the value is sum + c.
+struct sum_part {
+  f64 sum;
+  f64 c;
+};
+
+// Partial results combined in order, under whichever mode produced them.
+struct sum_acc {
+  f64 sum;
+  f64 c;
+  u64 count;
+  u32 depth;
+  f64 stack[SUM_PAIRWISE_DEPTH];
+};
+
+#define SUM_EXACT __attribute__((optimize("no-associative-math", "no-reciprocal-math")))
+
+SUM_EXACT
+static inline void sum_neumaier(f64 *sum, f64 *c, f64 x) {
+  f64 t = *sum + x;
+  *c += fabs(*sum) >= fabs(x) ? (*sum - t) + x : (x - t) + *sum;
+  *sum = t;
+}
+
+__attribute__((target_clones("avx512f", "avx2", "default")))
+SUM_EXACT
+struct sum_part sum_f64_kahan(const f64 *restrict values, u64 count) {
+  values = __builtin_assume_aligned(values, PAIRS_ALIGN);
+  f64 s[SUM_LANES] = {0};
+  f64 c[SUM_LANES] = {0};
+
+  u64 i = 0;
+  for (; i + SUM_LANES <= count; i += SUM_LANES) {
+    for (u32 l = 0; l < SUM_LANES; l++) {
+      f64 x = values[i + l];
+      f64 t = s[l] + x;
+      f64 v = t - s[l];
+      c[l] += (s[l] - (t - v)) + (x - v);
+      s[l] = t;
+    }
+  }
+
+  struct sum_part part = {0};
+  for (u32 l = 0; l < SUM_LANES; l++) {
+    sum_neumaier(&part.sum, &part.c, s[l]);
+    part.c += c[l];
+  }
+  for (; i < count; i++) {
+    sum_neumaier(&part.sum, &part.c, values[i]);
+  }
+  return part;
+}
+
+__attribute__((target_clones("avx512f", "avx2", "default")))
+SUM_EXACT
+static f64 sum_f64_pairwise_leaf(const f64 *restrict values, u64 count) {
+  f64 s[SUM_LANES] = {0};
+
+  u64 i = 0;
+  for (; i + SUM_LANES <= count; i += SUM_LANES) {
+    for (u32 l = 0; l < SUM_LANES; l++) {
+      s[l] += values[i + l];
+    }
+  }
+  for (u32 l = 0; i < count; i++, l++) {
+    s[l] += values[i];
+  }
+
+  return ((s[0] + s[1]) + (s[2] + s[3])) + ((s[4] + s[5]) + (s[6] + s[7]));
+}
+
+// Halves are split on whole leaves so the leaves stay vector aligned.
+SUM_EXACT
+f64 sum_f64_pairwise(const f64 *restrict values, u64 count) {
+  if (count <= SUM_PAIRWISE_LEAF) {
+    return sum_f64_pairwise_leaf(values, count);
+  }
+
+  u64 half = ((count / SUM_PAIRWISE_LEAF + 1) / 2) * SUM_PAIRWISE_LEAF;
+  return sum_f64_pairwise(values, half) + sum_f64_pairwise(values + half, count - half);
+}
+
+struct sum_part sum_batch(enum sum_mode mode, const f64 *restrict values, u64 count) {
+  switch (mode) {
+    case SUM_KAHAN:
+      return sum_f64_kahan(values, count);
+    case SUM_PAIRWISE:
+      return (struct sum_part){ sum_f64_pairwise(values, count), 0 };
+    default:
+      return (struct sum_part){ sum_f64(values, count), 0 };
+  }
+}
+
+// Pairwise partials go on a binary counter: the n-th one merges with as many
+// entries as n has trailing one bits, so equal sized partials always meet
+// their equals and the result only depends on how many there were.
+SUM_EXACT
+void sum_acc_add(struct sum_acc *acc, enum sum_mode mode, struct sum_part part) {
+  switch (mode) {
+    case SUM_KAHAN:
+      sum_neumaier(&acc->sum, &acc->c, part.sum);
+      acc->c += part.c;
+      break;
+    case SUM_PAIRWISE: {
+      f64 value = part.sum;
+      for (u64 n = acc->count; n & 1; n >>= 1) {
+        value = acc->stack[--acc->depth] + value;
+      }
+      acc->stack[acc->depth++] = value;
+      break;
+    }
+    default:
+      acc->sum += part.sum;
+      break;
+  }
+  acc->count++;
+}
+
+SUM_EXACT
+struct sum_part sum_acc_result(struct sum_acc *acc, enum sum_mode mode) {
+  if (mode == SUM_PAIRWISE) {
+    f64 value = 0;
+    for (u32 d = acc->depth; d-- > 0;) {
+      value = acc->stack[d] + value;
+    }
+    return (struct sum_part){ value, 0 };
+  }
+  return (struct sum_part){ acc->sum, acc->c };
+}
+
+// What the modes are measured against: the same values summed with Neumaier's
+// compensation in long double, which leaves no error visible at f64.
+struct sum_reference {
+  long double sum;
+  long double c;
+};
+
+SUM_EXACT
+void sum_reference_add(struct sum_reference *ref, const f64 *values, u64 count) {
+  for (u64 i = 0; i < count; i++) {
+    long double x = values[i];
+    long double t = ref->sum + x;
+    ref->c += fabsl(ref->sum) >= fabsl(x) ? (ref->sum - t) + x : (x - t) + ref->sum;
+    ref->sum = t;
+  }
+}
+
+static inline f64 sum_reference_result(struct sum_reference *ref) {
+  return (f64)(ref->sum + ref->c);
+}
+
+#endif
@@ -0,0 +1,824 @@
+#ifndef __INPUT_H__
+#define __INPUT_H__
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define INPUT_HAVE_URING 1
+#else
+#define INPUT_HAVE_URING 0
+#endif
+
+#include "shared.h"
+#include "prof.h"
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+enum read_mode {
+  READ_FREAD,
+  READ_MMAP,
+  READ_MMAP_HUGE,
+  READ_MMAP_WINDOW,
+
+  READ_MODE_COUNT,
+};
+
+const char *read_mode_names[READ_MODE_COUNT] = {
+  [READ_FREAD] = "fread",
+  [READ_MMAP] = "mmap",
+  [READ_MMAP_HUGE] = "hugepage",
+  [READ_MMAP_WINDOW] = "window",
+};
+
+struct input_file {
+  char *bytes;
+  u64 size;
+  enum read_mode mode;
+};
+
+b32 parse_read_mode(const char *name, enum read_mode *mode) {
+  for (u32 i = 0; i < READ_MODE_COUNT; i++) {
+    if (strcmp(name, read_mode_names[i]) == 0) {
+      *mode = (enum read_mode)i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void read_file_fread(char *filename, struct input_file *file) {
+  FILE *input_file = fopen(filename, "rb");
+
+  if (input_file == NULL) {
+    fprintf(stderr, "Could not open %s for reading\n", filename);
+    exit(1);
+  }
+
+  file->bytes = malloc(file->size);
+
+  if (file->bytes == NULL) {
+    fprintf(stderr, "Could not alloc %"PRIu64" bytes for reading %s\n", file->size, filename);
+    fclose(input_file);
+    exit(1);
+  }
+
+  {
+    PROF_BANDWIDTH("read", file->size);
+    if(fread(file->bytes, file->size, 1, input_file) != 1) {
+      fprintf(stderr, "Unable to read %s\n", filename);
+      free(file->bytes);
+      exit(1);
+    }
+  }
+
+  fclose(input_file);
+}
+
+// Map the file read-only instead of copying it. The page cache pages are
+// handed to us directly, so the only cost left is faulting them in, which we
+// do up front (MAP_POPULATE) so it shows up here and not in the lexer.
+static void read_file_mmap(char *filename, struct input_file *file) {
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s for reading\n", filename);
+    exit(1);
+  }
+
+  {
+    PROF_BANDWIDTH(file->mode == READ_MMAP_HUGE ? "read:huge" : "read:mmap", file->size);
+
+    // Huge pages have to be requested before the range is populated, so the
+    // hinted path maps lazily, advises, then prefaults in a second step.
+    int flags = MAP_PRIVATE;
+    if (file->mode == READ_MMAP) {
+      flags |= MAP_POPULATE;
+    }
+
+    void *bytes = mmap(NULL, file->size, PROT_READ, flags, fd, 0);
+    if (bytes == MAP_FAILED) {
+      fprintf(stderr, "Unable to mmap %s\n", filename);
+      close(fd);
+      exit(1);
+    }
+
+    madvise(bytes, file->size, MADV_SEQUENTIAL);
+
+    if (file->mode == READ_MMAP_HUGE) {
+      madvise(bytes, file->size, MADV_HUGEPAGE);
+
+      // MADV_POPULATE_READ needs 5.14+, touch each page ourselves otherwise.
+      if (madvise(bytes, file->size, MADV_POPULATE_READ) != 0) {
+        volatile char sink = 0;
+        for (u64 i = 0; i < file->size; i += 4096) {
+          sink ^= ((char *)bytes)[i];
+        }
+        (void)sink;
+      }
+    }
+
+    file->bytes = bytes;
+  }
+
+  close(fd);
+}
+
+struct input_file read_file(char *filename, enum read_mode mode) {
+  struct input_file file = {
+    .bytes = NULL,
+    .size = 0,
+    .mode = mode,
+  };
+
+  struct stat stats;
+
+  if (stat(filename, &stats) != 0) {
+    fprintf(stderr, "Could not open %s for reading\n", filename);
+    exit(1);
+  }
+
+  file.size = stats.st_size;
+
+  // Zero length mappings are invalid, and there is nothing to read anyway.
+  if (file.size == 0) {
+    return file;
+  }
+
+  switch (mode) {
+    case READ_MMAP:
+    case READ_MMAP_HUGE:
+      read_file_mmap(filename, &file);
+      break;
+    default:
+      read_file_fread(filename, &file);
+      break;
+  }
+
+  return file;
+}
+
+void free_input_file(struct input_file *file) {
+  if (file->bytes == NULL) {
+    return;
+  }
+
+  switch (file->mode) {
+    case READ_MMAP:
+    case READ_MMAP_HUGE:
+      munmap(file->bytes, file->size);
+      break;
+    default:
+      free(file->bytes);
+      break;
+  }
+
+  file->bytes = NULL;
+}
+
+/*******************************************************************************
+ * Sliding window
+ *
+ * For files too big to hold in memory. The whole file is mapped, since address
+ * space is cheap, but only a window around the consumer's cursor is ever
+ * resident: the next INPUT_WINDOW_STEP is requested ahead of it, and whatever
+ * falls a step behind is dropped from the mapping (MADV_DONTNEED) and from the
+ * page cache (POSIX_FADV_DONTNEED), so neither this process nor the cache grows
+ * with the file. A file of any size then runs in a few steps of memory at
+ * whatever rate the disk reads sequentially.
+ */
+
+#define INPUT_WINDOW_STEP (64ull << 20)
+
+struct input_window {
+  int fd;
+  char *bytes;
+  u64 size;
+  u64 cursor;
+  u64 released;
+  u64 requested;
+};
+
+struct input_window open_input_window(char *filename) {
+  struct input_window window = {0};
+  window.fd = open(filename, O_RDONLY);
+
+  struct stat stats;
+  if (window.fd < 0 || fstat(window.fd, &stats) != 0) {
+    fprintf(stderr, "Could not open %s for reading\n", filename);
+    exit(1);
+  }
+
+  window.size = stats.st_size;
+  if (window.size == 0) {
+    return window;
+  }
+
+  window.bytes = mmap(NULL, window.size, PROT_READ, MAP_PRIVATE, window.fd, 0);
+  if (window.bytes == MAP_FAILED) {
+    fprintf(stderr, "Unable to mmap %s\n", filename);
+    exit(1);
+  }
+
+  madvise(window.bytes, window.size, MADV_SEQUENTIAL);
+  posix_fadvise(window.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  return window;
+}
+
+// The run from the cursor to the end of the next step. Anything parsed out of
+// the input must fit in one step.
+static inline u64 input_window_len(struct input_window *window) {
+  u64 left = window->size - window->cursor;
+  return left < INPUT_WINDOW_STEP ? left : INPUT_WINDOW_STEP;
+}
+
+void input_window_advance(struct input_window *window, u64 consumed) {
+  window->cursor += consumed;
+
+  // One step of read-ahead past the run input_window_len() hands out.
+  u64 want = window->cursor + 2 * INPUT_WINDOW_STEP;
+  want = want < window->size ? want : window->size;
+  if (want > window->requested) {
+    madvise(window->bytes + window->requested, want - window->requested, MADV_WILLNEED);
+    window->requested = want;
+  }
+
+  // Page aligned, and a whole step behind so the tail being parsed stays.
+  u64 behind = window->cursor > INPUT_WINDOW_STEP ? (window->cursor - INPUT_WINDOW_STEP) & ~(u64)4095 : 0;
+  if (behind >= window->released + INPUT_WINDOW_STEP) {
+    u64 len = behind - window->released;
+    madvise(window->bytes + window->released, len, MADV_DONTNEED);
+    posix_fadvise(window->fd, (off_t)window->released, (off_t)len, POSIX_FADV_DONTNEED);
+    window->released = behind;
+  }
+}
+
+// Start at `offset` instead of the beginning, for a reader that only covers
+// the rest of the file. Several can share one mapping this way, as long as
+// each is given its own copy of the window and they cover disjoint ranges;
+// only the original is closed.
+void input_window_seek(struct input_window *window, u64 offset) {
+  window->cursor = offset;
+  window->released = offset & ~(u64)4095;
+  window->requested = window->released;
+  input_window_advance(window, 0);
+}
+
+void close_input_window(struct input_window *window) {
+  if (window->bytes != NULL) {
+    munmap(window->bytes, window->size);
+  }
+  close(window->fd);
+  *window = (struct input_window){0};
+}
+
+/*******************************************************************************
+ * Streaming
+ *
+ * For input consumed incrementally instead of being loaded whole, including
+ * pipes and stdin ("-"), which have no size to load. There are two fixed size
+ * buffers: the consumer works on one while the other is free, and advancing
+ * carries the unconsumed tail over to the free one and fills it up behind the
+ * tail. Memory stays at 2 * INPUT_STREAM_CHUNK whatever the input size, and
+ * anything parsed out of the stream must fit in one chunk.
+ */
+
+#define INPUT_STREAM_CHUNK (1 << 20)
+
+struct input_stream {
+  int fd;
+  char *buffer;
+  char *spare;
+  u64 cap;
+  u64 len;
+  u64 total;
+  u64 size;
+  b32 eof;
+};
+
+// Pipes and stdin can only be streamed, regular files can also be mapped.
+b32 input_is_regular(char *filename) {
+  struct stat stats;
+  return strcmp(filename, "-") != 0 && stat(filename, &stats) == 0 && S_ISREG(stats.st_mode);
+}
+
+static void input_stream_fill(struct input_stream *stream) {
+  if (stream->eof) {
+    return;
+  }
+
+  u64 want = stream->cap - stream->len;
+  if (stream->size && stream->size - stream->total < want) {
+    want = stream->size - stream->total;
+  }
+
+  PROF_BANDWIDTH("read:stream", want);
+
+  while (!stream->eof && stream->len < stream->cap) {
+    ssize_t n = read(stream->fd, stream->buffer + stream->len, stream->cap - stream->len);
+    if (n < 0) {
+      fprintf(stderr, "Unable to read input stream\n");
+      exit(1);
+    }
+    if (n == 0) {
+      stream->eof = 1;
+    }
+    stream->len += n;
+    stream->total += n;
+  }
+}
+
+struct input_stream open_input_stream(char *filename) {
+  b32 is_stdin = strcmp(filename, "-") == 0;
+  struct input_stream stream = {
+    .fd = is_stdin ? STDIN_FILENO : open(filename, O_RDONLY),
+    .buffer = malloc(INPUT_STREAM_CHUNK),
+    .spare = malloc(INPUT_STREAM_CHUNK),
+    .cap = INPUT_STREAM_CHUNK,
+    .len = 0,
+    .total = 0,
+    .size = 0,
+    .eof = 0,
+  };
+
+  if (stream.fd < 0) {
+    fprintf(stderr, "Could not open %s for reading\n", filename);
+    exit(1);
+  }
+
+  if (stream.buffer == NULL || stream.spare == NULL) {
+    fprintf(stderr, "Could not alloc %d bytes for reading %s\n", 2 * INPUT_STREAM_CHUNK, filename);
+    exit(1);
+  }
+
+  // Only a hint for reporting, the stream itself runs until EOF. Pipes have
+  // no size.
+  struct stat stats;
+  if (fstat(stream.fd, &stats) == 0 && S_ISREG(stats.st_mode)) {
+    stream.size = stats.st_size;
+    posix_fadvise(stream.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  input_stream_fill(&stream);
+  return stream;
+}
+
+// Drop the first `consumed` bytes: the tail moves to the front of the spare
+// buffer, which becomes current and is topped back up.
+void input_stream_advance(struct input_stream *stream, u64 consumed) {
+  u64 tail = stream->len - consumed;
+  memcpy(stream->spare, stream->buffer + consumed, tail);
+
+  char *done = stream->buffer;
+  stream->buffer = stream->spare;
+  stream->spare = done;
+  stream->len = tail;
+
+  input_stream_fill(stream);
+}
+
+void close_input_stream(struct input_stream *stream) {
+  if (stream->fd != STDIN_FILENO) {
+    close(stream->fd);
+  }
+  free(stream->buffer);
+  free(stream->spare);
+  stream->buffer = stream->spare = NULL;
+}
+
+/*******************************************************************************
+ * Read-ahead ring
+ *
+ * A ring of `count` fixed size slots that a reader fills ahead of the
+ * consumer, so reading overlaps with parsing instead of alternating with it.
+ * Regular files are read with io_uring where the kernel has it: every free
+ * slot has a read in flight at its own file offset, and nothing but the
+ * consumer runs in user space. Pipes, and kernels without io_uring, get a
+ * reader thread doing plain read()s into the free slots in order.
+ *
+ * Every slot has INPUT_RING_PAD bytes in front of its data. Handing over to
+ * the next slot copies the consumer's unconsumed tail into that pad, so the
+ * consumer always sees one contiguous run without anything being moved but
+ * the tail. A tail longer than the pad (a run of whitespace or a number over
+ * 4KB, valid JSON either way) goes through a heap buffer instead, tail and
+ * slot copied into it together.
+ *
+ * Both sides count the time they spend stalled: the consumer waiting on a slot
+ * that is not filled yet, and the reader with nothing free to fill. More slots
+ * only help while the reader is the one stalling.
+ */
+
+#define INPUT_RING_CHUNK (1 << 20)
+#define INPUT_RING_PAD 4096
+#define INPUT_RING_MAX 64
+
+enum input_ring_state {
+  INPUT_SLOT_FREE,
+  INPUT_SLOT_READING,
+  INPUT_SLOT_FULL,
+  INPUT_SLOT_CONSUMING,
+};
+
+struct input_ring_slot {
+  char *data;
+  u64 len;
+  u64 offset;
+  b32 eof;
+  enum input_ring_state state;
+};
+
+struct input_ring {
+  int fd;
+  b32 is_stdin;
+  u64 size;
+  u32 count;
+  u32 next;
+  b32 eof;
+  char *memory;
+  struct input_ring_slot slots[INPUT_RING_MAX];
+  // For tails that do not fit in the pad.
+  char *spill;
+
+  // Reader thread.
+  pthread_t reader;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t freed;
+  b32 quit;
+
+  // io_uring.
+  b32 uring;
+  int uring_fd;
+  u64 uring_offset;
+  u32 in_flight;
+  u64 idle_since;
+  u32 *sq_head;
+  u32 *sq_tail;
+  u32 *sq_mask;
+  u32 *sq_array;
+  u32 *cq_head;
+  u32 *cq_tail;
+  u32 *cq_mask;
+  void *sq_ring;
+  u64 sq_ring_size;
+  void *cq_ring;
+  u64 cq_ring_size;
+#if INPUT_HAVE_URING
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+#endif
+  u64 sqes_size;
+
+  u64 bytes;
+  u64 read_ticks;
+  u64 reader_stall_ticks;
+};
+
+static void *input_ring_reader(void *arg) {
+  struct input_ring *ring = arg;
+
+  for (u32 i = 0;; i = (i + 1) % ring->count) {
+    struct input_ring_slot *slot = &ring->slots[i];
+
+    u64 stall_start = prof_read_cpu_timer();
+    pthread_mutex_lock(&ring->lock);
+    while (slot->state != INPUT_SLOT_FREE && !ring->quit) {
+      pthread_cond_wait(&ring->freed, &ring->lock);
+    }
+    b32 quit = ring->quit;
+    pthread_mutex_unlock(&ring->lock);
+    ring->reader_stall_ticks += prof_read_cpu_timer() - stall_start;
+
+    if (quit) {
+      return NULL;
+    }
+
+    u64 read_start = prof_read_cpu_timer();
+    u64 len = 0;
+    b32 eof = 0;
+    while (len < INPUT_RING_CHUNK) {
+      ssize_t n = read(ring->fd, slot->data + len, INPUT_RING_CHUNK - len);
+      if (n < 0) {
+        fprintf(stderr, "Unable to read input stream\n");
+        exit(1);
+      }
+      if (n == 0) {
+        eof = 1;
+        break;
+      }
+      len += (u64)n;
+    }
+    ring->read_ticks += prof_read_cpu_timer() - read_start;
+    ring->bytes += len;
+
+    pthread_mutex_lock(&ring->lock);
+    slot->len = len;
+    slot->eof = eof;
+    slot->state = INPUT_SLOT_FULL;
+    pthread_cond_signal(&ring->filled);
+    pthread_mutex_unlock(&ring->lock);
+
+    if (eof) {
+      return NULL;
+    }
+  }
+}
+
+#if INPUT_HAVE_URING
+
+static b32 input_ring_uring_setup(struct input_ring *ring) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  long fd = syscall(__NR_io_uring_setup, ring->count, &params);
+  if (fd < 0) {
+    return 0;
+  }
+
+  ring->uring_fd = (int)fd;
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->uring_fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->uring_fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->uring_fd, IORING_OFF_SQES);
+
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    fprintf(stderr, "Unable to map io_uring\n");
+    exit(1);
+  }
+
+  u8 *sq = ring->sq_ring;
+  u8 *cq = ring->cq_ring;
+  ring->sq_head = (u32 *)(sq + params.sq_off.head);
+  ring->sq_tail = (u32 *)(sq + params.sq_off.tail);
+  ring->sq_mask = (u32 *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (u32 *)(sq + params.sq_off.array);
+  ring->cq_head = (u32 *)(cq + params.cq_off.head);
+  ring->cq_tail = (u32 *)(cq + params.cq_off.tail);
+  ring->cq_mask = (u32 *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 1;
+}
+
+// Queue a read for whatever part of the slot is still missing.
+static void input_ring_uring_submit(struct input_ring *ring, u32 index) {
+  struct input_ring_slot *slot = &ring->slots[index];
+  u32 tail = *ring->sq_tail;
+  u32 at = tail & *ring->sq_mask;
+
+  struct io_uring_sqe *sqe = &ring->sqes[at];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = ring->fd;
+  sqe->addr = (u64)(uintptr_t)(slot->data + slot->len);
+  sqe->len = (u32)(INPUT_RING_CHUNK - slot->len);
+  sqe->off = slot->offset + slot->len;
+  sqe->user_data = index;
+
+  ring->sq_array[at] = at;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  if (syscall(__NR_io_uring_enter, ring->uring_fd, 1, 0, 0, NULL, 0) < 0) {
+    fprintf(stderr, "Unable to submit read\n");
+    exit(1);
+  }
+}
+
+// Hand a free slot the next range of the file, if there is any left.
+static void input_ring_uring_start(struct input_ring *ring, u32 index) {
+  struct input_ring_slot *slot = &ring->slots[index];
+
+  if (ring->uring_offset >= ring->size) {
+    slot->len = 0;
+    slot->eof = 1;
+    slot->state = INPUT_SLOT_FULL;
+    return;
+  }
+
+  if (ring->in_flight == 0 && ring->idle_since) {
+    ring->reader_stall_ticks += prof_read_cpu_timer() - ring->idle_since;
+  }
+
+  slot->offset = ring->uring_offset;
+  slot->len = 0;
+  slot->eof = 0;
+  slot->state = INPUT_SLOT_READING;
+  ring->uring_offset += INPUT_RING_CHUNK;
+  ring->in_flight++;
+  input_ring_uring_submit(ring, index);
+}
+
+static void input_ring_uring_reap(struct input_ring *ring) {
+  u32 head = *ring->cq_head;
+
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    struct input_ring_slot *slot = &ring->slots[cqe->user_data];
+    head++;
+
+    if (cqe->res < 0) {
+      fprintf(stderr, "Unable to read input stream\n");
+      exit(1);
+    }
+
+    slot->len += (u64)cqe->res;
+    ring->bytes += (u64)cqe->res;
+
+    // Short reads only end the slot at the end of the file.
+    b32 done = slot->len == INPUT_RING_CHUNK || slot->offset + slot->len >= ring->size || cqe->res == 0;
+    if (done) {
+      slot->eof = slot->offset + slot->len >= ring->size;
+      slot->state = INPUT_SLOT_FULL;
+      if (--ring->in_flight == 0) {
+        ring->idle_since = prof_read_cpu_timer();
+      }
+    } else {
+      input_ring_uring_submit(ring, (u32)cqe->user_data);
+    }
+  }
+
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#endif
+
+struct input_ring *open_input_ring(char *filename, u32 count) {
+  struct input_ring *ring = calloc(1, sizeof(struct input_ring));
+  ring->is_stdin = strcmp(filename, "-") == 0;
+  ring->fd = ring->is_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+  ring->count = count < 2 ? 2 : count > INPUT_RING_MAX ? INPUT_RING_MAX : count;
+
+  if (ring->fd < 0) {
+    fprintf(stderr, "Could not open %s for reading\n", filename);
+    exit(1);
+  }
+
+  u64 stride = INPUT_RING_PAD + INPUT_RING_CHUNK;
+  ring->memory = aligned_alloc(4096, stride * ring->count);
+  if (ring->memory == NULL) {
+    fprintf(stderr, "Could not alloc %"PRIu64" bytes for reading %s\n", stride * ring->count, filename);
+    exit(1);
+  }
+
+  for (u32 i = 0; i < ring->count; i++) {
+    ring->slots[i].data = ring->memory + i * stride + INPUT_RING_PAD;
+    ring->slots[i].state = INPUT_SLOT_FREE;
+  }
+
+  struct stat stats;
+  b32 regular = fstat(ring->fd, &stats) == 0 && S_ISREG(stats.st_mode);
+  if (regular) {
+    ring->size = stats.st_size;
+    posix_fadvise(ring->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+#if INPUT_HAVE_URING
+  ring->uring = regular && input_ring_uring_setup(ring);
+  if (ring->uring) {
+    for (u32 i = 0; i < ring->count; i++) {
+      input_ring_uring_start(ring, i);
+    }
+    return ring;
+  }
+#endif
+
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->filled, NULL);
+  pthread_cond_init(&ring->freed, NULL);
+  if (pthread_create(&ring->reader, NULL, input_ring_reader, ring) != 0) {
+    fprintf(stderr, "Could not start reader thread\n");
+    exit(1);
+  }
+
+  return ring;
+}
+
+// Give back the current slot and take the next one, with the last `tail_len`
+// bytes of the current one carried over. Returns the start of the carried
+// tail, `*len` covers it and the new data. ring->eof is set once the returned
+// run is the last.
+char *input_ring_next(struct input_ring *ring, const char *tail, u64 tail_len, u64 *len) {
+  u32 prev = (ring->next + ring->count - 1) % ring->count;
+  struct input_ring_slot *slot = &ring->slots[ring->next];
+
+  {
+    PROF_BLOCK("stall:consume");
+#if INPUT_HAVE_URING
+    if (ring->uring) {
+      input_ring_uring_reap(ring);
+      while (slot->state != INPUT_SLOT_FULL) {
+        if (syscall(__NR_io_uring_enter, ring->uring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+          fprintf(stderr, "Unable to wait for reads\n");
+          exit(1);
+        }
+        input_ring_uring_reap(ring);
+      }
+    } else
+#endif
+    {
+      pthread_mutex_lock(&ring->lock);
+      while (slot->state != INPUT_SLOT_FULL) {
+        pthread_cond_wait(&ring->filled, &ring->lock);
+      }
+      pthread_mutex_unlock(&ring->lock);
+    }
+  }
+
+  // The tail may itself be in the spill buffer, so that is only let go of
+  // once it has been copied out.
+  char *run = slot->data - tail_len;
+  if (tail_len > INPUT_RING_PAD) {
+    char *spill = malloc(tail_len + slot->len);
+    if (spill == NULL) {
+      fprintf(stderr, "Could not alloc %"PRIu64" bytes for input token\n", tail_len + slot->len);
+      exit(1);
+    }
+    memcpy(spill, tail, tail_len);
+    memcpy(spill + tail_len, slot->data, slot->len);
+    free(ring->spill);
+    ring->spill = spill;
+    run = spill;
+  } else if (tail_len) {
+    memcpy(run, tail, tail_len);
+  }
+
+  // Only now is the tail out of the previous slot. The reader thread only
+  // looks at states under the lock, so they change under it too.
+  struct input_ring_slot *done = &ring->slots[prev];
+#if INPUT_HAVE_URING
+  if (ring->uring) {
+    slot->state = INPUT_SLOT_CONSUMING;
+    if (done->state == INPUT_SLOT_CONSUMING) {
+      done->state = INPUT_SLOT_FREE;
+      input_ring_uring_start(ring, prev);
+    }
+  } else
+#endif
+  {
+    pthread_mutex_lock(&ring->lock);
+    slot->state = INPUT_SLOT_CONSUMING;
+    if (done->state == INPUT_SLOT_CONSUMING) {
+      done->state = INPUT_SLOT_FREE;
+      pthread_cond_signal(&ring->freed);
+    }
+    pthread_mutex_unlock(&ring->lock);
+  }
+
+  ring->next = (ring->next + 1) % ring->count;
+  ring->eof = slot->eof;
+  *len = tail_len + slot->len;
+  return run;
+}
+
+void close_input_ring(struct input_ring *ring) {
+#if INPUT_HAVE_URING
+  if (ring->uring) {
+    // Reads still in flight write into the slots, let them land first.
+    while (ring->in_flight) {
+      syscall(__NR_io_uring_enter, ring->uring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      input_ring_uring_reap(ring);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sqes, ring->sqes_size);
+    close(ring->uring_fd);
+  } else
+#endif
+  {
+    pthread_mutex_lock(&ring->lock);
+    ring->quit = 1;
+    pthread_cond_signal(&ring->freed);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->reader, NULL);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->filled);
+    pthread_cond_destroy(&ring->freed);
+
+    // The reader's own time, it ran alongside everything else.
+    PROF_ADD("read:thread", ring->read_ticks, ring->bytes);
+  }
+
+  PROF_ADD("stall:read", ring->reader_stall_ticks, 0);
+
+  if (!ring->is_stdin) {
+    close(ring->fd);
+  }
+  free(ring->spill);
+  free(ring->memory);
+  free(ring);
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "shared.h"
+#include "prof.h"
+
+/*******************************************************************************
+ * Fork-join thread pool
+ *
+ * pool_run() hands the same task to every thread, the caller included as
+ * thread 0, and returns once all of them are done. Tasks split the work by
+ * their thread index, so there is no queue and nothing to lock per item.
+ * Profile blocks the task opens on a pool thread nest under the block that
+ * was open around pool_run(), see prof_adopt().
+ */
+
+#define POOL_MAX_THREADS 256
+
+struct pool;
+
+typedef void pool_task(void *ctx, u32 thread_index, u32 thread_count);
+
+struct pool_worker {
+  struct pool *pool;
+  pthread_t thread;
+  u32 index;
+};
+
+struct pool {
+  u32 count;
+  struct pool_worker workers[POOL_MAX_THREADS];
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  u64 generation;
+  u32 pending;
+  b32 quit;
+
+  pool_task *task;
+  void *ctx;
+  struct prof_origin origin;
+};
+
+static void *pool_worker_main(void *arg) {
+  struct pool_worker *worker = arg;
+  struct pool *pool = worker->pool;
+  u64 seen = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->generation == seen && !pool->quit) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->quit) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    seen = pool->generation;
+    pool_task *task = pool->task;
+    void *ctx = pool->ctx;
+    struct prof_origin origin = pool->origin;
+    pthread_mutex_unlock(&pool->lock);
+
+    PROF_ADOPT(origin);
+    task(ctx, worker->index, pool->count);
+    PROF_ADOPT((struct prof_origin){0});
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+// 0 means one thread per online CPU.
+void pool_init(struct pool *pool, u32 count) {
+  if (count == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    count = cpus > 0 ? (u32)cpus : 1;
+  }
+
+  if (count > POOL_MAX_THREADS) {
+    count = POOL_MAX_THREADS;
+  }
+
+  pool->count = count;
+  pool->generation = 0;
+  pool->pending = 0;
+  pool->quit = 0;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (u32 i = 1; i < count; i++) {
+    struct pool_worker *worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->index = i;
+    if (pthread_create(&worker->thread, NULL, pool_worker_main, worker) != 0) {
+      fprintf(stderr, "Could not start pool thread %u\n", i);
+      exit(1);
+    }
+  }
+}
+
+void pool_run(struct pool *pool, pool_task *task, void *ctx) {
+  if (pool->count > 1) {
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->ctx = ctx;
+    pool->origin = PROF_ORIGIN();
+    pool->pending = pool->count - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  task(ctx, 0, pool->count);
+
+  if (pool->count > 1) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending != 0) {
+      pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+void pool_destroy(struct pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (u32 i = 1; i < pool->count; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+}
+
+#endif
@@ -3,8 +3,10 @@
 
 #include <ctype.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 #include <x86intrin.h>
@@ -15,8 +17,21 @@
 #define PROF_ENABLE 0
 #endif
 
+#ifndef PROF_COUNTERS
+#define PROF_COUNTERS 1
+#endif
+
+#if PROF_COUNTERS
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #define PROF_MAX_CONTEXTS 4096
 #define PROF_MAX_CONTEXT_STACK 4096
+#define PROF_MAX_NODES 4096
+#define PROF_TRACE_EVENTS (1 << 16)
 
 u64 prof_get_os_timer_freq() {
   return 1000000;
@@ -58,6 +73,175 @@ static inline u64 prof_estimate_cpu_freq(u64 wait_ms) {
   return cpu_freq;
 }
 
+/*******************************************************************************
+ * Hardware counters
+ *
+ * Every block also accumulates the perf_event_open counters below, for every
+ * event the kernel and the machine offer (no PMU in a VM, perf_event_paranoid
+ * can rule some or all out; missing ones are left out of the report). Each
+ * event's page is mapped, and where it sets cap_user_rdpmc the event is read
+ * in user space with rdpmc, a few cycles with no syscall, so the counters can
+ * stay on in release builds. Events the kernel will not let us read that way,
+ * which always includes the page fault count as it is a software event, are
+ * read as one group with a single read(). Counters only count the thread that
+ * opened them, so every thread opens its own group when it first records a
+ * block. Build with -DPROF_COUNTERS=0 to leave them out entirely.
+ */
+
+enum prof_counter {
+  PROF_INSTRUCTIONS,
+  PROF_CYCLES,
+  PROF_LLC_MISSES,
+  PROF_BRANCH_MISSES,
+  PROF_PAGE_FAULTS,
+
+  PROF_COUNTER_COUNT,
+};
+
+struct prof_counters {
+  int fd;
+  u32 open;
+  u32 slots[PROF_COUNTER_COUNT];
+  b32 present[PROF_COUNTER_COUNT];
+  // Mapped for every present event, NULL when the kernel would not map it.
+  struct perf_event_mmap_page *pages[PROF_COUNTER_COUNT];
+  // Set if some present event has to be read with read().
+  b32 syscall;
+};
+
+// Set once timing begins. Threads that start recording later open their own.
+b32 prof_counting = 0;
+
+#if PROF_COUNTERS
+
+void prof_open_counters(struct prof_counters *counters) {
+  static const struct { u32 type; u64 config; } events[PROF_COUNTER_COUNT] = {
+    [PROF_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PROF_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PROF_LLC_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [PROF_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    [PROF_PAGE_FAULTS] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+  };
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+  for (u32 i = 0; i < PROF_COUNTER_COUNT; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+
+    // The first event that opens leads the group, the rest join it. Kernel
+    // side counts are wanted (faults taken inside read() are still ours) but
+    // perf_event_paranoid may only allow user space.
+    long fd = syscall(__NR_perf_event_open, &attr, 0, -1, counters->fd, 0);
+    if (fd < 0) {
+      attr.exclude_kernel = 1;
+      fd = syscall(__NR_perf_event_open, &attr, 0, -1, counters->fd, 0);
+    }
+    if (fd < 0) {
+      continue;
+    }
+
+    if (counters->fd < 0) {
+      counters->fd = (int)fd;
+    }
+    counters->slots[i] = counters->open++;
+    counters->present[i] = 1;
+
+    // The page only says whether rdpmc is allowed once it is mapped.
+    void *page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, (int)fd, 0);
+    if (page != MAP_FAILED) {
+      counters->pages[i] = page;
+    }
+    if (page == MAP_FAILED || !counters->pages[i]->cap_user_rdpmc) {
+      counters->syscall = 1;
+    }
+  }
+}
+
+void prof_close_counters(struct prof_counters *counters) {
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  for (u32 i = 0; i < PROF_COUNTER_COUNT; i++) {
+    if (counters->pages[i] != NULL) {
+      munmap(counters->pages[i], page_size);
+      counters->pages[i] = NULL;
+    }
+  }
+
+  // Closing the leader takes the group with it, siblings are reclaimed at exit.
+  if (counters->fd >= 0) {
+    close(counters->fd);
+    counters->fd = -1;
+  }
+}
+
+// The kernel's recipe for reading an event from user space: the count is the
+// page's offset plus the live hardware counter, sign extended from its width,
+// retried if the event was rescheduled (lock changed) in between. An index of
+// 0 means the event is not on a counter right now and offset is the count.
+static inline u64 prof_read_user_counter(struct perf_event_mmap_page *page) {
+  u32 seq;
+  u64 count;
+  do {
+    seq = page->lock;
+    __asm__ __volatile__("" ::: "memory");
+    u32 index = page->index;
+    count = (u64)page->offset;
+    if (index) {
+      u32 shift = 64 - page->pmc_width;
+      s64 pmc = (s64)__rdpmc((int)index - 1);
+      count += (u64)((s64)((u64)pmc << shift) >> shift);
+    }
+    __asm__ __volatile__("" ::: "memory");
+  } while (page->lock != seq);
+  return count;
+}
+
+static inline void prof_read_counters(struct prof_counters *counters, u64 *out) {
+  if (counters->fd < 0) {
+    return;
+  }
+
+  u64 values[1 + PROF_COUNTER_COUNT];
+  b32 read_ok = !counters->syscall;
+  if (counters->syscall) {
+    read_ok = read(counters->fd, values, sizeof(values)) >= (ssize_t)sizeof(u64);
+  }
+
+  for (u32 i = 0; i < PROF_COUNTER_COUNT; i++) {
+    if (!counters->present[i]) {
+      continue;
+    }
+    struct perf_event_mmap_page *page = counters->pages[i];
+    if (page != NULL && page->cap_user_rdpmc) {
+      out[i] = prof_read_user_counter(page);
+    } else if (read_ok) {
+      out[i] = values[1 + counters->slots[i]];
+    }
+  }
+}
+
+#else
+
+void prof_open_counters(struct prof_counters *counters) {
+}
+
+void prof_close_counters(struct prof_counters *counters) {
+}
+
+static inline void prof_read_counters(struct prof_counters *counters, u64 *out) {
+}
+
+#endif
+
+// One node of the call tree: an anchor under a particular parent node. The
+// same label reached from two parents is two nodes.
+//
+// Anchor index 0 marks a node that stands in for a node of another thread,
+// see prof_adopt() below.
 struct prof_context {
   u64 start;
   u64 duration;
@@ -65,119 +249,590 @@ struct prof_context {
   u64 count;
   u64 bytes;
   u32 index;
-  u32 stack_count;
+  u32 parent;
+  u32 first_child;
+  u32 last_child;
+  u32 next_sibling;
   const char *label;
+  // Inclusive, like `duration`.
+  u64 counters[PROF_COUNTER_COUNT];
+  b32 timed;
+  // For a stand-in, the node it stands in for.
+  struct prof_thread *origin_thread;
+  u32 origin_node;
+  // Where prof_end_timing() folded this node into the sum of all threads.
+  u32 merged;
 };
 
-struct prof_context prof_contexts[PROF_MAX_CONTEXTS] = {0};
+// An open block. The readings are the ones taken at its start.
+struct prof_open_block {
+  u64 start;
+  u64 bytes;
+  u32 node;
+  b32 outermost;
+  u64 counters[PROF_COUNTER_COUNT];
+};
 
 struct prof_context_stack {
-  struct prof_context items[PROF_MAX_CONTEXT_STACK];
+  struct prof_open_block items[PROF_MAX_CONTEXT_STACK];
   s32 sp;
 };
-struct prof_context_stack prof_context_stack = {
-  .sp = -1,
+
+/*******************************************************************************
+ * Threads
+ *
+ * Every thread records into its own call tree and stack, found through a
+ * thread local pointer, so a block costs the same on any thread and never
+ * takes a lock or touches an atomic. A thread's state is allocated and linked
+ * into prof_threads (under a mutex) the first time it records anything, and is
+ * kept after the thread exits; prof_end_timing() walks the list and reports
+ * each thread and then their sum.
+ */
+
+// One finished block on the timeline, see prof_trace() below.
+struct prof_trace_event {
+  u64 start;
+  u64 end;
+  u32 node;
+  u32 pad;
+};
+
+struct prof_thread {
+  // Node 0 is the root, everything opened outside any other block hangs off it.
+  struct prof_context nodes[PROF_MAX_NODES];
+  u32 node_count;
+  // Per anchor, the node of its outermost open block, 0 while it is closed.
+  u32 open[PROF_MAX_CONTEXTS];
+  // Per anchor, the node it last resolved to, which is almost always the one.
+  u32 last[PROF_MAX_CONTEXTS];
+  struct prof_context_stack stack;
+  // What a block opened with nothing else open hangs off: the root, or the
+  // stand-in for whoever handed this thread its current task.
+  u32 base;
+  struct prof_counters counters;
+  // A ring of PROF_TRACE_EVENTS, NULL unless tracing.
+  struct prof_trace_event *events;
+  u64 event_count;
+  u32 id;
+  struct prof_thread *next;
 };
 
-void prof_end_time_block(u32 *index) {
-  u64 end = prof_read_cpu_timer();
+static __thread struct prof_thread *prof_thread_local = NULL;
+
+const char *prof_trace_path = NULL;
+
+pthread_mutex_t prof_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+struct prof_thread *prof_threads = NULL;
+u32 prof_thread_count = 0;
 
-  /*
-  printf("[");
-  for (int i = 0; i <= timing_context_stack.sp; i++) {
-    struct timing_context c = timing_context_stack.items[i];
-    printf(" %s(%d)", c.label, c.index);
+static void prof_alloc_trace(struct prof_thread *thread) {
+  thread->events = malloc(sizeof(struct prof_trace_event) * PROF_TRACE_EVENTS);
+  if (thread->events == NULL) {
+    fprintf(stderr, "Could not alloc trace events for thread\n");
+    exit(1);
   }
-  printf("]\n");
-  */
+}
+
+struct prof_thread *prof_alloc_thread(void) {
+  struct prof_thread *thread = calloc(1, sizeof(struct prof_thread));
+  if (thread == NULL) {
+    fprintf(stderr, "Could not alloc profiler state for thread\n");
+    exit(1);
+  }
+
+  thread->node_count = 1;
+  thread->stack.sp = -1;
+  thread->counters.fd = -1;
+  return thread;
+}
+
+struct prof_thread *prof_register_thread(void) {
+  struct prof_thread *thread = prof_alloc_thread();
+
+  if (prof_counting) {
+    prof_open_counters(&thread->counters);
+  }
+  if (prof_trace_path != NULL) {
+    prof_alloc_trace(thread);
+  }
+
+  // Appended, so threads report in the order they first recorded.
+  pthread_mutex_lock(&prof_threads_lock);
+  struct prof_thread **tail = &prof_threads;
+  while (*tail != NULL) {
+    tail = &(*tail)->next;
+  }
+  *tail = thread;
+  thread->id = prof_thread_count++;
+  pthread_mutex_unlock(&prof_threads_lock);
+
+  prof_thread_local = thread;
+  return thread;
+}
+
+static inline struct prof_thread *prof_this_thread(void) {
+  struct prof_thread *thread = prof_thread_local;
+  if (__builtin_expect(thread == NULL, 0)) {
+    thread = prof_register_thread();
+  }
+  return thread;
+}
+
+// Appends a child to `parent`.
+static u32 prof_new_node(struct prof_thread *thread, u32 parent, u32 index, const char *label) {
+  struct prof_context *nodes = thread->nodes;
+
+  if (thread->node_count == PROF_MAX_NODES) {
+    fprintf(stderr, "Profile call tree exceeds PROF_MAX_NODES\n");
+    exit(1);
+  }
+
+  u32 node = thread->node_count++;
+  nodes[node].index = index;
+  nodes[node].parent = parent;
+  nodes[node].label = label;
+  if (nodes[parent].last_child) {
+    nodes[nodes[parent].last_child].next_sibling = node;
+  } else {
+    nodes[parent].first_child = node;
+  }
+  nodes[parent].last_child = node;
+  return node;
+}
+
+// The node for `index` under `parent`, made on first use. Blocks are entered
+// from the same place over and over, so the last node an anchor resolved to is
+// checked before the parent's children are walked.
+static u32 prof_child_slow(struct prof_thread *thread, u32 parent, u32 index, const char *label) {
+  struct prof_context *nodes = thread->nodes;
+
+  for (u32 child = nodes[parent].first_child; child != 0; child = nodes[child].next_sibling) {
+    if (nodes[child].index == index) {
+      return child;
+    }
+  }
+
+  return prof_new_node(thread, parent, index, label);
+}
+
+static inline u32 prof_child(struct prof_thread *thread, u32 parent, u32 index, const char *label) {
+  u32 node = thread->last[index];
+  if (node == 0 || thread->nodes[node].parent != parent) {
+    node = prof_child_slow(thread, parent, index, label);
+    thread->last[index] = node;
+  }
+  return node;
+}
+
+static inline u32 prof_current_node(struct prof_thread *thread) {
+  struct prof_context_stack *stack = &thread->stack;
+  return stack->sp > -1 ? stack->items[stack->sp].node : thread->base;
+}
+
+/*******************************************************************************
+ * Handing work to other threads
+ *
+ * A block run on a pool thread for a task has no parent on that thread, so it
+ * would land at the root, beside the block that started the task instead of
+ * under it. The submitting thread takes prof_origin() (its thread and open
+ * node) and the thread running the task calls prof_adopt() with it, which
+ * makes a stand-in node for that origin under its root and opens its blocks
+ * below that until prof_adopt() is called with an empty origin. The stand-in
+ * is invisible in the thread's own report; in the sum of all threads its
+ * children are merged under the origin node itself.
+ */
+
+struct prof_origin {
+  struct prof_thread *thread;
+  u32 node;
+};
+
+static inline struct prof_origin prof_origin(void) {
+  struct prof_thread *thread = prof_thread_local;
+  struct prof_origin origin = { thread, thread != NULL ? prof_current_node(thread) : 0 };
+  return origin;
+}
+
+void prof_adopt(struct prof_origin origin) {
+  // Nothing to nest under, and the submitter running its own task nests as is.
+  if (origin.node == 0 || origin.thread == prof_thread_local) {
+    if (prof_thread_local != NULL) {
+      prof_thread_local->base = 0;
+    }
+    return;
+  }
+
+  struct prof_thread *thread = prof_this_thread();
+  struct prof_context *nodes = thread->nodes;
+
+  for (u32 child = nodes[0].first_child; child != 0; child = nodes[child].next_sibling) {
+    if (nodes[child].index == 0 && nodes[child].origin_thread == origin.thread && nodes[child].origin_node == origin.node) {
+      thread->base = child;
+      return;
+    }
+  }
+
+  u32 node = prof_new_node(thread, 0, 0, origin.thread->nodes[origin.node].label);
+  nodes[node].origin_thread = origin.thread;
+  nodes[node].origin_node = origin.node;
+  thread->base = node;
+}
+
+/*******************************************************************************
+ * Timeline
+ *
+ * The totals hide when things happen: where reads stall, how parse and sum
+ * overlap. With prof_trace(path) every block that ends also writes its start
+ * and end tsc into its thread's preallocated ring, three stores and a bump,
+ * and at prof_end_timing() the rings are written out as Chrome trace-event
+ * JSON for chrome://tracing or ui.perfetto.dev. A thread that overflows its
+ * ring keeps the latest PROF_TRACE_EVENTS blocks. Time added with prof_add()
+ * has no position on the timeline and is left out.
+ */
+
+// Turn tracing on for every thread, before the blocks to trace run.
+void prof_trace(const char *path) {
+  prof_trace_path = path;
+
+  // Threads that already recorded never come through registration again.
+  pthread_mutex_lock(&prof_threads_lock);
+  for (struct prof_thread *thread = prof_threads; thread != NULL; thread = thread->next) {
+    if (thread->events == NULL) {
+      prof_alloc_trace(thread);
+    }
+  }
+  pthread_mutex_unlock(&prof_threads_lock);
+}
+
+static void prof_write_trace_string(FILE *out, const char *value) {
+  fputc('"', out);
+  for (const char *c = value; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', out);
+    }
+    fputc(*c, out);
+  }
+  fputc('"', out);
+}
+
+// Timestamps are microseconds from the start of timing, what the format wants.
+void prof_write_trace(struct prof_thread *threads, u64 start, u64 cpu_freq) {
+  FILE *out = fopen(prof_trace_path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open %s for writing\n", prof_trace_path);
+    return;
+  }
+
+  f64 us_per_tick = 1e6 / (f64)cpu_freq;
+  u64 written = 0;
+  u64 dropped = 0;
+  const char *separator = "\n";
+
+  fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+  for (struct prof_thread *thread = threads; thread != NULL; thread = thread->next) {
+    fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %"PRIu32", "
+        "\"args\": {\"name\": \"thread %"PRIu32"\"}}", separator, thread->id, thread->id);
+    separator = ",\n";
+
+    if (thread->events == NULL) {
+      continue;
+    }
+
+    u64 first = thread->event_count > PROF_TRACE_EVENTS ? thread->event_count - PROF_TRACE_EVENTS : 0;
+    dropped += first;
+
+    for (u64 i = first; i < thread->event_count; i++) {
+      struct prof_trace_event *event = &thread->events[i & (PROF_TRACE_EVENTS - 1)];
+      fprintf(out, ",\n{\"name\": ");
+      prof_write_trace_string(out, thread->nodes[event->node].label);
+      fprintf(out, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %"PRIu32", \"ts\": %.3f, \"dur\": %.3f}",
+          thread->id,
+          (f64)(event->start - start) * us_per_tick,
+          (f64)(event->end - event->start) * us_per_tick);
+      written++;
+    }
+  }
+  fprintf(out, "\n]}\n");
+  fclose(out);
+
+  printf("Trace: %"PRIu64" events to %s", written, prof_trace_path);
+  if (dropped) {
+    printf(" (%"PRIu64" oldest dropped)", dropped);
+  }
+  printf("\n");
+}
+
+static inline void prof_begin_time_block(u32 index, const char *label, u64 bytes) {
+  struct prof_thread *thread = prof_this_thread();
+  struct prof_context_stack *stack = &thread->stack;
+
+  // A block already open further up (recursion) keeps timing into the node
+  // of its outermost call; only that one adds its time when it ends, so
+  // nothing is counted twice.
+  u32 node = thread->open[index];
+  b32 outermost = node == 0;
+  if (outermost) {
+    node = prof_child(thread, prof_current_node(thread), index, label);
+    thread->open[index] = node;
+  }
+
+  struct prof_open_block *block = &stack->items[++stack->sp];
+  block->bytes = bytes;
+  block->node = node;
+  block->outermost = outermost;
+  prof_read_counters(&thread->counters, block->counters);
+  block->start = prof_read_cpu_timer();
+}
+
+void prof_end_time_block(u32 *index) {
+  u64 end = prof_read_cpu_timer();
+  struct prof_thread *thread = prof_thread_local;
+  u64 counters[PROF_COUNTER_COUNT] = {0};
+  prof_read_counters(&thread->counters, counters);
 
   // Pop
-  struct prof_context stack_ctx = prof_context_stack.items[prof_context_stack.sp--];
-  struct prof_context *list_ctx = &prof_contexts[stack_ctx.index];
-  u64 duration = end - stack_ctx.start;
+  struct prof_context_stack *stack = &thread->stack;
+  struct prof_open_block block = stack->items[stack->sp--];
+  struct prof_context *node = &thread->nodes[block.node];
+  u64 duration = end - block.start;
+
+  if (thread->events != NULL) {
+    struct prof_trace_event *event = &thread->events[thread->event_count++ & (PROF_TRACE_EVENTS - 1)];
+    event->start = block.start;
+    event->end = end;
+    event->node = block.node;
+  }
 
-  // Without this, we end up counting sub-calls towards the total duration.
-  uint8_t is_recursing = (--list_ctx->stack_count) != 0;
+  // Bytes belong to every call, time only to the outermost one.
+  node->bytes += block.bytes;
 
-  if (!is_recursing) {
-    // Copy
-    list_ctx->index = stack_ctx.index;
-    list_ctx->start = stack_ctx.start;
-    list_ctx->label = stack_ctx.label;
-    list_ctx->bytes = stack_ctx.bytes;
+  if (block.outermost) {
+    thread->open[*index] = 0;
 
-    // Update
-    list_ctx->duration += duration;
-    list_ctx->count++;
+    node->start = block.start;
+    node->duration += duration;
+    node->count++;
+    node->timed = 1;
+    for (u32 i = 0; i < PROF_COUNTER_COUNT; i++) {
+      node->counters[i] += counters[i] - block.counters[i];
+    }
 
     // Increment child duration on next item
-    if (prof_context_stack.sp > -1) {
-      struct prof_context top = prof_context_stack.items[prof_context_stack.sp];
-      prof_contexts[top.index].child_duration += duration;
+    if (stack->sp > -1) {
+      thread->nodes[stack->items[stack->sp].node].child_duration += duration;
     }
   }
 }
 
-void prof_end_timing(u64 *start) {
-  u64 end = prof_read_cpu_timer();
-  u64 duration = end - *start;
-  u64 cpu_freq = prof_estimate_cpu_freq(100);
+// Counters of one block, whichever of them exist.
+static void prof_print_counters(struct prof_context *ctx, const b32 *present, u32 depth) {
+  static const char *names[PROF_COUNTER_COUNT] = {
+    [PROF_LLC_MISSES] = "llc miss",
+    [PROF_BRANCH_MISSES] = "branch miss",
+    [PROF_PAGE_FAULTS] = "faults",
+  };
+  const u64 *counters = ctx->counters;
+  const char *separator = "";
+
+  printf("  %*s%16s", depth * 2, "", "");
+  if (present[PROF_INSTRUCTIONS] && present[PROF_CYCLES] && counters[PROF_CYCLES]) {
+    printf("ipc %.2f", (f64)counters[PROF_INSTRUCTIONS] / (f64)counters[PROF_CYCLES]);
+    separator = " | ";
+  }
 
-  printf("\nTotal: %0.2fms (%"PRIu64" ticks at %"PRIu64"hz)\n", ((f64)duration / (f64)cpu_freq) * 1000, duration, cpu_freq);
+  for (u32 i = PROF_LLC_MISSES; i < PROF_COUNTER_COUNT; i++) {
+    if (!present[i]) {
+      continue;
+    }
 
-  for (u32 i = 1; i < PROF_MAX_CONTEXTS; i++) {
-    struct prof_context ctx = prof_contexts[i];
-    if (ctx.start == 0) {
-      break;
+    printf("%s%s %"PRIu64, separator, names[i], counters[i]);
+    if (ctx->bytes) {
+      printf(" (%.3f/kb)", (f64)counters[i] * 1024.0 / (f64)ctx->bytes);
     }
+    separator = " | ";
+  }
+  printf("\n");
+}
+
+// A node and everything under it, children indented below their parent. The
+// first figures are the node's own (exclusive) time, the braces its time with
+// its children (inclusive), which is also what bandwidth is measured over.
+static void prof_print_node(struct prof_context *nodes, u32 index, const b32 *present, u32 depth, u64 duration, u64 cpu_freq) {
+  struct prof_context ctx = nodes[index];
 
-    printf("  %12s: %6.2f%% (%0.2fms %"PRIu64")",
-        ctx.label, 
-        ((f64)(ctx.duration - ctx.child_duration)/ (f64)duration) * 100,
-        ((f64)(ctx.duration - ctx.child_duration)/ (f64)cpu_freq) * 1000,
+  // A stand-in has no time of its own, what ran under it shows in its place.
+  if (ctx.index == 0) {
+    for (u32 child = ctx.first_child; child != 0; child = nodes[child].next_sibling) {
+      prof_print_node(nodes, child, present, depth, duration, cpu_freq);
+    }
+    return;
+  }
+  u64 exclusive = ctx.duration - ctx.child_duration;
+
+  int pad = 14 - (int)(depth * 2 + strlen(ctx.label));
+  printf("  %*s%s:%*s %6.2f%% (%0.2fms %"PRIu64")",
+      depth * 2, "",
+      ctx.label,
+      pad > 0 ? pad : 0, "",
+      ((f64)exclusive / (f64)duration) * 100,
+      ((f64)exclusive / (f64)cpu_freq) * 1000,
+      exclusive
+      );
+
+  if (ctx.child_duration > 0) {
+    printf(" { %0.2f%% (%0.2fms %"PRIu64") }",
+        ((f64)ctx.duration / (f64)duration) * 100,
+        ((f64)ctx.duration / (f64)cpu_freq) * 1000,
         ctx.duration
         );
+  }
+
+  printf(" [%"PRIu64"]", ctx.count);
+
+  if (ctx.bytes > 0) {
+    /*
+         f64 Megabyte = 1024.0f*1024.0f;
+  f64 Gigabyte = Megabyte*1024.0f;
+      
+  f64 Seconds = (f64)Anchor->TSCElapsedInclusive / (f64)TimerFreq;
+  f64 BytesPerSecond = (f64)Anchor->ProcessedByteCount / Seconds;
+  f64 Megabytes = (f64)Anchor->ProcessedByteCount / (f64)Megabyte;
+  f64 GigabytesPerSecond = BytesPerSecond / Gigabyte;
+     
+  printf("  %.3fmb at %.2fgb/s", Megabytes, GigabytesPerSecond);
+  */
+    f64 MB = 1024.0f*1024.0f;
+    f64 GB = MB*(f64)1024.0f;
+
+    f64 seconds = (f64)ctx.duration / (f64)cpu_freq;
+    f64 bytes_per_second = (f64)ctx.bytes / seconds;
+    f64 mb = (f64)ctx.bytes / MB;
+    f64 gbs = bytes_per_second / GB;
+
+    printf(" | %.3fmb at %.2fgb/s", mb, gbs);
+  }
+
+  printf("\n");
+
+  // Blocks added with prof_add() have no counters of their own.
+  if (present != NULL && ctx.timed) {
+    prof_print_counters(&ctx, present, depth);
+  }
+
+  for (u32 child = ctx.first_child; child != 0; child = nodes[child].next_sibling) {
+    prof_print_node(nodes, child, present, depth + 1, duration, cpu_freq);
+  }
+}
+
+static void prof_print_tree(struct prof_context *nodes, const b32 *present, u64 duration, u64 cpu_freq) {
+  for (u32 child = nodes[0].first_child; child != 0; child = nodes[child].next_sibling) {
+    prof_print_node(nodes, child, present, 0, duration, cpu_freq);
+  }
+}
 
-    if (ctx.child_duration > 0) {
-      printf(" { %0.2f%% (%0.2fms %"PRIu64") }",
-          ((f64)(ctx.child_duration)/ (f64)duration) * 100,
-          ((f64)(ctx.child_duration)/ (f64)cpu_freq) * 1000,
-          ctx.child_duration
-          );
+// Adds the subtree under `node` into `into` under `parent`, matching children
+// by anchor, so the same path on two threads lands on one node. A stand-in's
+// subtree goes under wherever its origin was merged, so the origin's thread
+// has to be merged first; it was recording before it handed out the task, so
+// it registered, and comes in the list, before the thread that ran it.
+static void prof_merge_node(struct prof_thread *into, u32 parent, struct prof_thread *from, u32 node) {
+  struct prof_context *nodes = from->nodes;
+
+  for (u32 child = nodes[node].first_child; child != 0; child = nodes[child].next_sibling) {
+    struct prof_context *source = &nodes[child];
+    if (source->index == 0) {
+      source->merged = source->origin_thread->nodes[source->origin_node].merged;
+      prof_merge_node(into, source->merged, from, child);
+      continue;
     }
 
-    printf(" [%"PRIu64"]", ctx.count);
+    u32 merged = prof_child_slow(into, parent, source->index, source->label);
+    source->merged = merged;
+    struct prof_context *target = &into->nodes[merged];
+
+    target->start = target->start ? target->start : source->start;
+    target->duration += source->duration;
+    target->child_duration += source->child_duration;
+    target->count += source->count;
+    target->bytes += source->bytes;
+    target->timed |= source->timed;
+    for (u32 c = 0; c < PROF_COUNTER_COUNT; c++) {
+      target->counters[c] += source->counters[c];
+    }
+
+    prof_merge_node(into, merged, from, child);
+  }
+}
+
+u64 prof_begin_timing(void) {
+  prof_counting = 1;
+  prof_this_thread();
+  return prof_read_cpu_timer();
+}
+
+void prof_end_timing(u64 *start) {
+  u64 end = prof_read_cpu_timer();
+  u64 duration = end - *start;
+  u64 cpu_freq = prof_estimate_cpu_freq(100);
 
-    if (ctx.bytes > 0) {
-      /*
-           f64 Megabyte = 1024.0f*1024.0f;
-    f64 Gigabyte = Megabyte*1024.0f;
-        
-    f64 Seconds = (f64)Anchor->TSCElapsedInclusive / (f64)TimerFreq;
-    f64 BytesPerSecond = (f64)Anchor->ProcessedByteCount / Seconds;
-    f64 Megabytes = (f64)Anchor->ProcessedByteCount / (f64)Megabyte;
-    f64 GigabytesPerSecond = BytesPerSecond / Gigabyte;
-       
-    printf("  %.3fmb at %.2fgb/s", Megabytes, GigabytesPerSecond);
-    */
-      f64 MB = 1024.0f*1024.0f;
-      f64 GB = MB*(f64)1024.0f;
+  printf("\nTotal: %0.2fms (%"PRIu64" ticks at %"PRIu64"hz)\n", ((f64)duration / (f64)cpu_freq) * 1000, duration, cpu_freq);
 
-      f64 seconds = (f64)ctx.duration / (f64)cpu_freq;
-      f64 bytes_per_second = (f64)ctx.bytes / seconds;
-      f64 mb = (f64)ctx.bytes / MB;
-      f64 gbs = bytes_per_second / GB;
+  // Threads that are still running (an idle pool) are not recording, so their
+  // tables can be read without stopping them.
+  pthread_mutex_lock(&prof_threads_lock);
+  struct prof_thread *threads = prof_threads;
+  u32 thread_count = prof_thread_count;
+  pthread_mutex_unlock(&prof_threads_lock);
+
+  // The counters shown in the sum are the ones any thread managed to open.
+  struct prof_thread *merged = prof_alloc_thread();
+  b32 present[PROF_COUNTER_COUNT] = {0};
+  b32 any_present = 0;
+
+  for (struct prof_thread *thread = threads; thread != NULL; thread = thread->next) {
+    for (u32 c = 0; c < PROF_COUNTER_COUNT; c++) {
+      present[c] |= thread->counters.present[c];
+      any_present |= thread->counters.present[c];
+    }
+    prof_merge_node(merged, 0, thread, 0);
+  }
 
-      printf(" | %.3fmb at %.2fgb/s", mb, gbs);
+  // With more than one thread each gets its own tree, as a share of the wall
+  // clock, and the sum follows (which can add up to more than 100%).
+  if (thread_count > 1) {
+    for (struct prof_thread *thread = threads; thread != NULL; thread = thread->next) {
+      printf("Thread %"PRIu32":\n", thread->id);
+      prof_print_tree(thread->nodes, thread->counters.open ? thread->counters.present : NULL, duration, cpu_freq);
     }
+    printf("All threads:\n");
+  }
+  prof_print_tree(merged->nodes, any_present ? present : NULL, duration, cpu_freq);
 
-    printf("\n");
+  if (prof_trace_path != NULL) {
+    prof_write_trace(threads, *start, cpu_freq);
   }
 
+  for (struct prof_thread *thread = threads; thread != NULL; thread = thread->next) {
+    prof_close_counters(&thread->counters);
+  }
+  free(merged);
+}
+
+// Time measured somewhere the block macros cannot reach, e.g. on another
+// thread, recorded under the block open on the calling thread. It ran
+// alongside that block rather than inside it, so it is not counted as part of
+// its children.
+void prof_add(u32 index, const char *label, u64 duration, u64 bytes) {
+  struct prof_thread *thread = prof_this_thread();
+  struct prof_context *ctx = &thread->nodes[prof_child(thread, prof_current_node(thread), index, label)];
+  ctx->start = prof_read_cpu_timer();
+  ctx->duration += duration;
+  ctx->bytes += bytes;
+  ctx->count++;
 }
 
 #define PROF_INIT() \
-  u64 __start__ __attribute__((cleanup(prof_end_timing))) = prof_read_cpu_timer()
+  u64 __start__ __attribute__((cleanup(prof_end_timing))) = prof_begin_timing()
 
 #define PROF_CLEANUP() \
   _Static_assert(__COUNTER__ < PROF_MAX_CONTEXTS, "Number of profile points exceeds PROF_MAX_CONTEXTS")
@@ -186,23 +841,26 @@ void prof_end_timing(u64 *start) {
 
 #define PROF_BANDWIDTH(l,b) \
   u32 __index__ __attribute__((cleanup(prof_end_time_block))) = __COUNTER__ + 1; \
-  prof_contexts[__index__].stack_count++; \
-  prof_context_stack.items[++prof_context_stack.sp] = (struct prof_context){\
-    .index = __index__,\
-    .start = prof_read_cpu_timer(),\
-    .label = l,\
-    .bytes = b,\
-  }
+  prof_begin_time_block(__index__, l, b)
 
 #define PROF_BLOCK(l) PROF_BANDWIDTH(l, 0)
 
 #define PROF_FUNCTION() PROF_BLOCK(__func__)
 
+#define PROF_ADD(l, ticks, b) prof_add(__COUNTER__ + 1, l, ticks, b)
+
+#define PROF_ORIGIN() prof_origin()
+
+#define PROF_ADOPT(o) prof_adopt(o)
+
 #else
 
 #define PROF_BANDWIDTH(...) 
 #define PROF_BLOCK(...) 
 #define PROF_FUNCTION(...) 
+#define PROF_ADD(...) 
+#define PROF_ORIGIN() ((struct prof_origin){0})
+#define PROF_ADOPT(o) ((void)(o))
 
 #endif
 
@@ -0,0 +1,173 @@
+#ifndef __REPTEST_H__
+#define __REPTEST_H__
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include "shared.h"
+#include "prof.h"
+
+/*******************************************************************************
+ * Repetition tester
+ *
+ * One timed run says little: whether the page cache is warm, how the pages
+ * fault in and where the clock is in its ramp all swing it by 2x. Instead a
+ * test body runs over and over, timing itself with rep_begin()/rep_end(),
+ * until its fastest run has not improved for the given number of seconds. The
+ * min is then the best case the machine can do, and avg/max show how far off
+ * the typical run is. Page faults are read from getrusage() outside the timed
+ * region, so they cost a syscall per run but never show up in the time.
+ *
+ *   struct rep_tester tester;
+ *   rep_new_wave(&tester, "read", bytes, cpu_freq, seconds);
+ *   while (rep_is_testing(&tester)) {
+ *     rep_begin(&tester);
+ *     ... work ...
+ *     rep_end(&tester);
+ *     rep_count_bytes(&tester, bytes);
+ *   }
+ *   rep_print(&tester);
+ */
+
+struct rep_result {
+  u64 ticks;
+  u64 bytes;
+  u64 faults;
+};
+
+struct rep_tester {
+  const char *label;
+  u64 cpu_freq;
+  u64 expected_bytes;
+  u64 try_for;
+  u64 tests_started;
+  b32 error;
+
+  // The run in progress. A body may time several pieces of itself.
+  u32 open_blocks;
+  u32 close_blocks;
+  u64 start_ticks;
+  u64 start_faults;
+  struct rep_result run;
+
+  u64 count;
+  struct rep_result total;
+  struct rep_result min;
+  struct rep_result max;
+};
+
+static inline u64 rep_read_faults(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (u64)usage.ru_minflt + (u64)usage.ru_majflt;
+}
+
+void rep_new_wave(struct rep_tester *tester, const char *label, u64 expected_bytes, u64 cpu_freq, u32 seconds) {
+  *tester = (struct rep_tester){
+    .label = label,
+    .cpu_freq = cpu_freq,
+    .expected_bytes = expected_bytes,
+    .try_for = (u64)seconds * cpu_freq,
+    .tests_started = prof_read_cpu_timer(),
+    .min = { .ticks = ~0ull },
+  };
+}
+
+void rep_error(struct rep_tester *tester, const char *message) {
+  fprintf(stderr, "%s: %s\n", tester->label, message);
+  tester->error = 1;
+}
+
+static inline void rep_begin(struct rep_tester *tester) {
+  tester->open_blocks++;
+  tester->start_faults = rep_read_faults();
+  tester->start_ticks = prof_read_cpu_timer();
+}
+
+static inline void rep_end(struct rep_tester *tester) {
+  u64 ticks = prof_read_cpu_timer() - tester->start_ticks;
+  tester->run.ticks += ticks;
+  tester->run.faults += rep_read_faults() - tester->start_faults;
+  tester->close_blocks++;
+}
+
+static inline void rep_count_bytes(struct rep_tester *tester, u64 bytes) {
+  tester->run.bytes += bytes;
+}
+
+// Folds the finished run in and decides whether to go again. A new min
+// restarts the clock, so the wave ends try_for ticks after the last one.
+b32 rep_is_testing(struct rep_tester *tester) {
+  if (tester->error) {
+    return 0;
+  }
+
+  u64 now = prof_read_cpu_timer();
+
+  if (tester->open_blocks) {
+    struct rep_result run = tester->run;
+
+    if (tester->open_blocks != tester->close_blocks) {
+      rep_error(tester, "unbalanced rep_begin/rep_end");
+      return 0;
+    }
+    if (run.bytes != tester->expected_bytes) {
+      rep_error(tester, "processed byte count mismatch");
+      return 0;
+    }
+
+    tester->count++;
+    tester->total.ticks += run.ticks;
+    tester->total.bytes += run.bytes;
+    tester->total.faults += run.faults;
+
+    if (run.ticks > tester->max.ticks) {
+      tester->max = run;
+    }
+    if (run.ticks < tester->min.ticks) {
+      tester->min = run;
+      tester->tests_started = now;
+    }
+
+    tester->open_blocks = 0;
+    tester->close_blocks = 0;
+    tester->run = (struct rep_result){0};
+  }
+
+  return now - tester->tests_started < tester->try_for;
+}
+
+static void rep_print_result(const char *label, struct rep_result result, u64 cpu_freq) {
+  f64 seconds = (f64)result.ticks / (f64)cpu_freq;
+  printf("  %12s: %8.2fms", label, seconds * 1000);
+  if (result.bytes && seconds > 0) {
+    printf(" %8.2fgb/s", (f64)result.bytes / seconds / (1024.0*1024.0*1024.0));
+  }
+  printf(" %8"PRIu64" faults", result.faults);
+  if (result.faults) {
+    printf(" (%.2fkb/fault)", (f64)result.bytes / (f64)result.faults / 1024.0);
+  }
+  printf("\n");
+}
+
+void rep_print(struct rep_tester *tester) {
+  if (tester->error || tester->count == 0) {
+    return;
+  }
+
+  u64 count = tester->count;
+  struct rep_result avg = {
+    .ticks = tester->total.ticks / count,
+    .bytes = tester->total.bytes / count,
+    .faults = tester->total.faults / count,
+  };
+
+  printf("%s: %"PRIu64" runs\n", tester->label, count);
+  rep_print_result("min", tester->min, tester->cpu_freq);
+  rep_print_result("avg", avg, tester->cpu_freq);
+  rep_print_result("max", tester->max, tester->cpu_freq);
+}
+
+#endif